@@ -3,347 +3,4577 @@
 #include <linux/fs.h>
 #include <linux/file.h>
 
-#define DB_MAIN_PATH "/tmp/asyncmsg_db.json"
-#define DB_META_PATH "/tmp/asyncmsg_meta.json"
-#define DB_DLQ_PATH "/tmp/asyncmsg_dlq.json"
+#define CREATE_TRACE_POINTS
+#include "asyncmsg_trace.h"
 
-static struct asyncmsg_dev asyncmsg_dev;
+#define DB_LOG_PATH "/tmp/asyncmsg%d_log.bin"
+#define DB_CKPT_PATH "/tmp/asyncmsg%d_ckpt.bin"
+#define DB_DLQ_PATH "/tmp/asyncmsg%d_dlq.json"
+
+static int nr_queues = 1;
+module_param(nr_queues, int, S_IRUGO);
+MODULE_PARM_DESC(nr_queues, "number of queues created at load, /dev/asyncmsg0..N-1");
+
+static struct asyncmsg_dev *asyncmsg_devs[ASYNCMSG_MAX_QUEUES];
+static int asyncmsg_nr_devs;
+static DEFINE_MUTEX(asyncmsg_devs_lock);
 static dev_t asyncmsg_devno;
 static struct class *asyncmsg_class;
+static struct workqueue_struct *asyncmsg_wq;
 static int asyncmsg_major = 0;
 
 static void asyncmsg_timer_fn(struct timer_list *t);
-static void asyncmsg_tasklet_fn(unsigned long arg);
+static void asyncmsg_cls_work_fn(struct work_struct *work);
+static int culc_free_space(struct asyncmsg_dev *dev, struct asyncmsg_lane *lane);
+static int asyncmsg_resize(struct asyncmsg_dev *dev, int new_size);
+static int asyncmsg_add_queue(void);
+static void asyncmsg_uring_kick_rx(struct asyncmsg_dev *dev);
+static void asyncmsg_uring_kick_tx(struct asyncmsg_dev *dev);
+static void asyncmsg_cursor_put(struct asyncmsg_file *ctx);
+static void asyncmsg_leases_release(struct asyncmsg_file *ctx);
 
-static void save_to_json_db(struct async_msg *msg)
+static inline unsigned int asyncmsg_lane_count(struct asyncmsg_lane *lane)
 {
-    struct file *f;
-    loff_t pos = 0;
-    char buf[512];
-    int len;
+    /* includes slots that are reserved but not yet published */
+    return atomic64_read(&lane->tail) - atomic64_read(&lane->head);
+}
 
-    /* O_APPEND гарантує, що нові записи будуть додаватись в кінець */
-    f = filp_open(DB_MAIN_PATH, O_WRONLY | O_CREAT | O_APPEND, 0666);
-    if (IS_ERR(f)) {
-        printk(KERN_ERR "asyncmsg: failed to open main db file\n");
-        return;
+static inline unsigned int asyncmsg_count(struct asyncmsg_dev *dev)
+{
+    unsigned int n = 0;
+
+    for (int i = 0; i < ASYNC_MSG_PRIO_LEVELS; i++)
+        n += asyncmsg_lane_count(&dev->lanes[i]);
+    return n;
+}
+
+static inline struct async_msg *asyncmsg_slot(struct asyncmsg_lane *lane, u64 pos)
+{
+    return &lane->queue[pos & lane->ring_mask];
+}
+
+/* true when the message at pos has been published by its producer */
+static inline bool asyncmsg_pos_ready(struct asyncmsg_lane *lane, u64 pos)
+{
+    return smp_load_acquire(&asyncmsg_slot(lane, pos)->ready) == (u32)(pos + 1);
+}
+
+static inline bool asyncmsg_lane_ready(struct asyncmsg_lane *lane)
+{
+    return asyncmsg_pos_ready(lane, atomic64_read(&lane->head));
+}
+
+/* true when some lane has a published message at its head */
+static inline bool asyncmsg_head_ready(struct asyncmsg_dev *dev)
+{
+    for (int i = ASYNC_MSG_PRIO_LEVELS - 1; i >= 0; i--)
+        if (asyncmsg_lane_ready(&dev->lanes[i]))
+            return true;
+    return false;
+}
+
+/*
+ * Where ctx reads lane l from: its cursor in fan-out mode, the lane head
+ * otherwise. A fan-out file without a cursor yet starts at the head too.
+ */
+static inline u64 asyncmsg_read_pos(struct asyncmsg_file *ctx, int l)
+{
+    struct asyncmsg_cursor *cur = READ_ONCE(ctx->cursor);
+
+    if (cur)
+        return READ_ONCE(cur->pos[l]);
+    return atomic64_read(&ctx->dev->lanes[l].head);
+}
+
+/*
+ * Lanes ctx reads. A shared queue leaves the ones outside the filter's
+ * prio_mask to other readers, a fan-out cursor reads and passes them by.
+ */
+static inline bool asyncmsg_lane_wanted(struct asyncmsg_file *ctx, int l)
+{
+    u32 mask = READ_ONCE(ctx->filter.prio_mask);
+
+    return !mask || (mask & (1U << l)) || READ_ONCE(ctx->dev->fanout);
+}
+
+/* asyncmsg_head_ready() as seen by one reader */
+static inline bool asyncmsg_ctx_ready(struct asyncmsg_file *ctx)
+{
+    for (int i = ASYNC_MSG_PRIO_LEVELS - 1; i >= 0; i--)
+        if (asyncmsg_lane_wanted(ctx, i) &&
+            asyncmsg_pos_ready(&ctx->dev->lanes[i], asyncmsg_read_pos(ctx, i)))
+            return true;
+    return false;
+}
+
+/* messages ctx has not read yet */
+static inline unsigned int asyncmsg_ctx_count(struct asyncmsg_file *ctx)
+{
+    unsigned int n = 0;
+
+    for (int i = 0; i < ASYNC_MSG_PRIO_LEVELS; i++)
+        n += atomic64_read(&ctx->dev->lanes[i].tail) - asyncmsg_read_pos(ctx, i);
+    return n;
+}
+
+static const unsigned int asyncmsg_class_size[ASYNCMSG_NR_CLASSES] = ASYNCMSG_CLASS_SIZES;
+static struct kmem_cache *asyncmsg_class_cache[ASYNCMSG_NR_CLASSES];
+
+/* smallest size class that holds len bytes */
+static int asyncmsg_size_class(u32 len)
+{
+    int i = 0;
+
+    while (asyncmsg_class_size[i] < len)
+        i++;
+    return i;
+}
+
+static char *asyncmsg_payload_alloc(u32 len)
+{
+    return kmem_cache_alloc(asyncmsg_class_cache[asyncmsg_size_class(len)], GFP_KERNEL);
+}
+
+static void asyncmsg_payload_free(char *data, u32 len)
+{
+    if (data)
+        kmem_cache_free(asyncmsg_class_cache[asyncmsg_size_class(len)], data);
+}
+
+static void asyncmsg_caches_destroy(void)
+{
+    for (int i = 0; i < ASYNCMSG_NR_CLASSES; i++)
+    {
+        kmem_cache_destroy(asyncmsg_class_cache[i]);
+        asyncmsg_class_cache[i] = NULL;
     }
+}
 
-    len = snprintf(buf, sizeof(buf),
-        "{\"entity\": \"message\", \"timestamp_ns\": %llu, \"len\": %zu, \"msg\": \"%s\", \"processed\": %s}\n",
-        msg->timestamp_ns, msg->len, msg->msg, msg->processed ? "true" : "false");
+static int asyncmsg_caches_create(void)
+{
+    char name[32];
 
-    kernel_write(f, buf, len, &pos);
-    filp_close(f, NULL);
+    for (int i = 0; i < ASYNCMSG_NR_CLASSES; i++)
+    {
+        snprintf(name, sizeof(name), "asyncmsg_%u", asyncmsg_class_size[i]);
+        asyncmsg_class_cache[i] = kmem_cache_create(name, asyncmsg_class_size[i], 0, 0, NULL);
+        if (!asyncmsg_class_cache[i])
+        {
+            asyncmsg_caches_destroy();
+            return -ENOMEM;
+        }
+    }
+    return 0;
 }
 
-static void save_meta_db(struct asyncmsg_dev *dev)
+/*
+ * Word-at-a-time byte classes. For bytes below 0x80 neither the add nor the
+ * subtract carries into the next byte, so bit 7 of each byte of the result
+ * says whether lo <= byte <= hi. Bytes with bit 7 set are masked out.
+ */
+#define ASYNCMSG_ONES 0x0101010101010101ULL
+#define ASYNCMSG_HIGHS 0x8080808080808080ULL
+
+static inline u64 asyncmsg_bytes_between(u64 x, u8 lo, u8 hi)
 {
-    struct file *f;
-    loff_t pos = 0;
-    char buf[512];
-    int len;
+    u64 ge_lo = (x | ASYNCMSG_HIGHS) - ASYNCMSG_ONES * lo;
+    u64 gt_hi = x + ASYNCMSG_ONES * (127 - hi);
 
-    /* O_TRUNC перезаписує файл, щоб там завжди був лише актуальний стан */
-    f = filp_open(DB_META_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    if (IS_ERR(f)) {
-        printk(KERN_ERR "asyncmsg: failed to open meta db file\n");
-        return;
+    return ge_lo & ~gt_hi & ASYNCMSG_HIGHS;
+}
+
+static void asyncmsg_classify(struct async_msg *msg)
+{
+    const char *p = asyncmsg_data(msg);
+    u32 alpha = 0, digit = 0, space = 0;
+    u32 left = msg->len;
+
+    while (left)
+    {
+        u64 w = 0, x;
+
+        if (left >= sizeof(w))
+        {
+            w = get_unaligned((const u64 *)p);
+            p += sizeof(w);
+            left -= sizeof(w);
+        }
+        else
+        {
+            /* zero bytes fall in no class, they only pad the last word */
+            memcpy(&w, p, left);
+            left = 0;
+        }
+        x = w & ~ASYNCMSG_HIGHS;
+        w = ~w & ASYNCMSG_HIGHS;
+        /* | 0x20 folds A-Z onto a-z and moves nothing else into it */
+        alpha += hweight64(asyncmsg_bytes_between(x | ASYNCMSG_ONES * 0x20, 'a', 'z') & w);
+        digit += hweight64(asyncmsg_bytes_between(x, '0', '9') & w);
+        space += hweight64((asyncmsg_bytes_between(x, '\t', '\r') |
+                            asyncmsg_bytes_between(x, ' ', ' ')) & w);
     }
 
-    len = snprintf(buf, sizeof(buf),
-        "{\"entity\": \"statistics\", \"max_queue_size\": %d, \"head\": %d, \"tail\": %d, \"free_messages\": %d, \"open_count\": %d}\n",
-        dev->max_queue_size, dev->head, dev->tail, dev->free_messages, dev->open_count);
+    msg->cls.alpha = alpha;
+    msg->cls.digit = digit;
+    msg->cls.space = space;
+    msg->cls.other = msg->len - alpha - digit - space;
+    msg->classified = true;
+}
 
-    kernel_write(f, buf, len, &pos);
-    filp_close(f, NULL);
+static void asyncmsg_msg_free(struct async_msg *msg)
+{
+    asyncmsg_payload_free(msg->ext, msg->len);
+    msg->ext = NULL;
 }
 
-static void save_to_dlq_db(const char *msg_text, size_t len, const char *reason)
+/* copies a payload into msg, inline when it fits */
+static int asyncmsg_msg_fill(struct async_msg *msg, const char *data, u32 len)
 {
-    struct file *f;
-    loff_t pos = 0;
-    char buf[512];
-    int json_len;
+    msg->ext = NULL;
+    if (len > MSG_INLINE_LEN)
+    {
+        msg->ext = asyncmsg_payload_alloc(len);
+        if (!msg->ext)
+            return -ENOMEM;
+    }
+    memcpy(asyncmsg_data(msg), data, len);
+    msg->len = len;
+    return 0;
+}
+
+static inline u64 asyncmsg_key(const char *data)
+{
+    return get_unaligned((const u64 *)data);
+}
 
-    f = filp_open(DB_DLQ_PATH, O_WRONLY | O_CREAT | O_APPEND, 0666);
-    if (IS_ERR(f)) return;
+static const struct rhashtable_params asyncmsg_key_params = {
+    .key_len = sizeof(struct asyncmsg_key_id),
+    .key_offset = offsetof(struct asyncmsg_key_ent, id),
+    .head_offset = offsetof(struct asyncmsg_key_ent, node),
+    .automatic_shrinking = true,
+};
 
-    json_len = snprintf(buf, sizeof(buf),
-        "{\"entity\": \"dead_letter\", \"timestamp_ns\": %llu, \"len\": %zu, \"msg\": \"%s\", \"reason\": \"%s\"}\n",
-        ktime_get_ns(), len, msg_text, reason);
+static struct asyncmsg_key_ent *asyncmsg_key_find(struct asyncmsg_dev *dev, unsigned int prio, u64 key)
+{
+    struct asyncmsg_key_id id = { .key = key, .prio = prio };
 
-    kernel_write(f, buf, json_len, &pos);
-    filp_close(f, NULL);
+    return rhashtable_lookup_fast(&dev->keys, &id, asyncmsg_key_params);
 }
 
-static void asyncmsg_contructor(void *ptr)
+/* the keyed message at pos of lane prio leaves the queue, under sem */
+static void asyncmsg_key_unindex(struct asyncmsg_dev *dev, unsigned int prio, u64 pos,
+                                 struct async_msg *msg)
 {
-    memset(ptr, 0, sizeof(struct async_msg));
-    printk(KERN_INFO "asyncmsg: initializing slab object\n");
+    struct asyncmsg_key_ent *ent = asyncmsg_key_find(dev, prio, asyncmsg_key(asyncmsg_data(msg)));
+
+    /* an older copy of the key from before compaction was on */
+    if (!ent || ent->pos != pos)
+        return;
+    rhashtable_remove_fast(&dev->keys, &ent->node, asyncmsg_key_params);
+    kfree_rcu(ent, rcu);
 }
 
-static int culc_free_space(struct asyncmsg_dev *dev)
+static inline void asyncmsg_stat_dequeue(struct asyncmsg_dev *dev, const struct async_msg *msg, u64 now)
 {
-    return (dev->tail < asyncmsg_dev.max_queue_size) ? (asyncmsg_dev.max_queue_size - dev->tail) : 0;
+    u64 lat = now > msg->timestamp_ns ? now - msg->timestamp_ns : 0;
+
+    this_cpu_inc(dev->stats->dequeued);
+    this_cpu_add(dev->stats->dequeued_bytes, msg->len);
+    this_cpu_inc(dev->stats->lat_ns[min(fls64(lat), ASYNC_MSG_LAT_BUCKETS - 1)]);
 }
 
-static int asyncmsg_fasync(int fd, struct file *file, int on)
+/* one cmpxchg at most, and only when a new high is reached */
+static inline void asyncmsg_stat_depth(struct asyncmsg_dev *dev, u64 depth)
 {
-    struct asyncmsg_dev *dev = file->private_data;
-    return fasync_helper(fd, file, on, &dev->fasync_queue);
+    s64 hwm = atomic64_read(&dev->depth_hwm);
+
+    while ((s64)depth > hwm && !atomic64_try_cmpxchg(&dev->depth_hwm, &hwm, depth))
+        ;
 }
 
-static int asyncmsg_open(struct inode *inode, struct file *filp)
+/*
+ * Frees the out-of-line payloads of [head, new_head) and hands the slots
+ * back to producers, under dev->lock like the ring swap in resize. Consumed
+ * slots count as dequeued, CLEAR_IO drops them without and expired ones
+ * were counted already.
+ */
+static void asyncmsg_release_slots(struct asyncmsg_dev *dev, struct asyncmsg_lane *lane,
+                                   u64 head, u64 new_head, bool consumed)
 {
-    filp->private_data = &asyncmsg_dev;
+    unsigned int prio = lane - dev->lanes;
     unsigned long flags;
+    u64 now = consumed ? ktime_get_ns() : 0;
 
-    spin_lock_irqsave(&asyncmsg_dev.lock, flags);
-    asyncmsg_dev.open_count++;
-    printk(KERN_INFO "asyncmsg: opened device, major=%d, minor=%d\n",
-        MAJOR(inode->i_rdev), MINOR(inode->i_rdev));
-    spin_unlock_irqrestore(&asyncmsg_dev.lock, flags);
-    return 0;
+    spin_lock_irqsave(&dev->lock, flags);
+    if (consumed && head < new_head && trace_asyncmsg_dequeue_enabled())
+        trace_asyncmsg_dequeue(dev->index, head, new_head,
+                               now - min(now, asyncmsg_slot(lane, head)->timestamp_ns));
+    for (u64 pos = head; pos < new_head; pos++)
+    {
+        struct async_msg *msg = asyncmsg_slot(lane, pos);
+
+        if (consumed && !msg->expired)
+            asyncmsg_stat_dequeue(dev, msg, now);
+        if (msg->keyed && dev->compact)
+            asyncmsg_key_unindex(dev, prio, pos, msg);
+        asyncmsg_msg_free(msg);
+    }
+    atomic64_set_release(&lane->head, new_head);
+    spin_unlock_irqrestore(&dev->lock, flags);
 }
 
-static int asyncmsg_release(struct inode *inode, struct file *file)
+/* kicks heavy_job now when asked or when enough is staged, otherwise after PERSIST_FLUSH_MS */
+static void asyncmsg_persist_kick(struct asyncmsg_dev *dev, bool now)
 {
-    unsigned long flags;
+    if (now)
+        mod_delayed_work(dev->wq, &dev->heavy_job, 0);
+    else if (!delayed_work_pending(&dev->heavy_job))
+        queue_delayed_work(dev->wq, &dev->heavy_job, msecs_to_jiffies(PERSIST_FLUSH_MS));
+}
 
-    spin_lock_irqsave(&asyncmsg_dev.lock, flags);
-    asyncmsg_dev.open_count--;
-    printk(KERN_INFO "asyncmsg: released device, major=%d, minor=%d\n",
-            MAJOR(inode->i_rdev), MINOR(inode->i_rdev));
-    spin_unlock_irqrestore(&asyncmsg_dev.lock, flags);  
-    return 0;
+/*
+ * Copies one record into this CPU's staging buffer. Only blocks when the
+ * worker has fallen a whole staging buffer behind, which is the backpressure
+ * we want.
+ */
+static void asyncmsg_persist_append(struct asyncmsg_dev *dev, const void *rec, size_t hdr_len,
+                                    const void *payload, size_t payload_len, u64 seq)
+{
+    size_t len = hdr_len + payload_len;
+    struct asyncmsg_persist *p = &dev->persist;
+    struct asyncmsg_stage *st;
+    bool full;
+
+    for (;;)
+    {
+        st = get_cpu_ptr(p->stages);
+        spin_lock(&st->lock);
+        if (st->len + len <= PERSIST_STAGE_SIZE)
+            break;
+        spin_unlock(&st->lock);
+        put_cpu_ptr(p->stages);
+
+        asyncmsg_persist_kick(dev, true);
+        wait_event(p->flush_q, READ_ONCE(st->len) + len <= PERSIST_STAGE_SIZE);
+    }
+    memcpy(st->buf + st->len, rec, hdr_len);
+    memcpy(st->buf + st->len + hdr_len, payload, payload_len);
+    st->len += len;
+    if (seq > st->max_seq[ASYNCMSG_SEQ_LANE(seq)])
+        st->max_seq[ASYNCMSG_SEQ_LANE(seq)] = seq;
+    st->lanes |= 1U << ASYNCMSG_SEQ_LANE(seq);
+    full = st->len >= PERSIST_FLUSH_BYTES;
+    spin_unlock(&st->lock);
+    put_cpu_ptr(p->stages);
+
+    asyncmsg_persist_kick(dev, full);
 }
 
-static ssize_t asyncmsg_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+/* gen is only there for a keyed record */
+static u32 asyncmsg_log_crc(const struct asyncmsg_log_rec *rec, const u64 *gen, const char *payload)
 {
-    char tmp[RETURN_MESSAGE];
-    struct asyncmsg_dev *dev = file->private_data;
-    int len;
+    struct asyncmsg_log_rec hdr = *rec;
+    u32 crc;
 
-    if (*ppos > 0)
+    hdr.crc = 0;
+    crc = crc32_le(~0, &hdr, sizeof(hdr));
+    if (gen)
+        crc = crc32_le(crc, gen, sizeof(*gen));
+    return crc32_le(crc, payload, hdr.len);
+}
+
+static void save_to_log(struct asyncmsg_dev *dev, struct async_msg *msg)
+{
+    struct asyncmsg_log_rec_keyed k;
+    struct asyncmsg_log_rec *rec = &k.rec;
+    const char *data = asyncmsg_data(msg);
+
+    rec->magic = msg->keyed ? ASYNCMSG_LOG_MAGIC_KEYED : ASYNCMSG_LOG_MAGIC;
+    rec->len = msg->len;
+    rec->seq = msg->seq;
+    rec->timestamp_ns = msg->timestamp_ns;
+    rec->ttl_ms = msg->ttl_ms;
+    if (msg->keyed)
     {
-        return 0;
+        k.gen = atomic64_inc_return(&dev->persist.key_gen);
+        rec->crc = asyncmsg_log_crc(rec, &k.gen, data);
+        asyncmsg_persist_append(dev, &k, sizeof(k), data, msg->len, msg->seq);
+        return;
+    }
+    rec->crc = asyncmsg_log_crc(rec, NULL, data);
+
+    asyncmsg_persist_append(dev, rec, sizeof(*rec), data, msg->len, msg->seq);
+}
+
+/* the checkpoint is rewritten once per flush, not once per consumed message */
+static void save_checkpoint(struct asyncmsg_dev *dev, unsigned int prio, u64 seq)
+{
+    struct asyncmsg_persist *p = &dev->persist;
+
+    spin_lock(&p->lock);
+    p->ckpt_seq[prio] = seq;
+    p->ckpt_dirty = true;
+    spin_unlock(&p->lock);
+
+    asyncmsg_persist_kick(dev, false);
+}
+
+/* seq of the message at pos, replayed ones keep the seq they were logged under */
+static u64 asyncmsg_pos_seq(const struct asyncmsg_lane *lane, u64 pos)
+{
+    return pos < lane->replay_end ? lane->replay_seq[pos] : pos + lane->seq_base;
+}
+
+/* checkpoints lane prio at head, or at its oldest unacked lease when that is older */
+static void asyncmsg_checkpoint_lane(struct asyncmsg_dev *dev, unsigned int prio, u64 head)
+{
+    struct asyncmsg_lease *ls;
+    u64 seq = asyncmsg_pos_seq(&dev->lanes[prio], head);
+
+    spin_lock(&dev->lease_lock);
+    ls = list_first_entry_or_null(&dev->leases[prio], struct asyncmsg_lease, lane_node);
+    if (ls)
+        seq = min(seq, ls->msg.seq);
+    spin_unlock(&dev->lease_lock);
+
+    save_checkpoint(dev, prio, seq);
+}
+
+/* a reader is done with lane prio up to new_head */
+static void asyncmsg_consume(struct asyncmsg_dev *dev, unsigned int prio, u64 new_head)
+{
+    struct asyncmsg_lane *lane = &dev->lanes[prio];
+
+    asyncmsg_release_slots(dev, lane, atomic64_read(&lane->head), new_head, true);
+    asyncmsg_checkpoint_lane(dev, prio, new_head);
+}
+
+static void write_checkpoint(struct asyncmsg_dev *dev, const u64 *seq, u64 off)
+{
+    struct asyncmsg_ckpt ckpt = {
+        .magic = ASYNCMSG_CKPT_MAGIC,
+        .max_queue_size = dev->max_queue_size,
+        .off = off,
+    };
+    loff_t pos = 0;
+
+    memcpy(ckpt.seq, seq, sizeof(ckpt.seq));
+    ckpt.crc = crc32_le(~0, &ckpt, sizeof(ckpt));
+    kernel_write(dev->persist.ckpt_file, &ckpt, sizeof(ckpt), &pos);
+}
+
+/* takes the pre-lane layout as well, its seq belongs to lane 0 */
+static bool read_checkpoint(struct asyncmsg_dev *dev, struct asyncmsg_ckpt *ckpt)
+{
+    struct asyncmsg_ckpt_v1 v1;
+    loff_t pos = 0;
+    u32 crc;
+
+    if (kernel_read(dev->persist.ckpt_file, ckpt, sizeof(*ckpt), &pos) == sizeof(*ckpt) &&
+        ckpt->magic == ASYNCMSG_CKPT_MAGIC)
+    {
+        crc = ckpt->crc;
+        ckpt->crc = 0;
+        return crc32_le(~0, ckpt, sizeof(*ckpt)) == crc;
     }
 
-    int ret = wait_event_interruptible_timeout(dev->read_q, dev->free_messages > 0, msecs_to_jiffies(15000));
-    if(ret == 0)
+    pos = 0;
+    if (kernel_read(dev->persist.ckpt_file, &v1, sizeof(v1), &pos) != sizeof(v1) ||
+        v1.magic != ASYNCMSG_CKPT_MAGIC_V1)
+        return false;
+    crc = v1.crc;
+    v1.crc = 0;
+    if (crc32_le(~0, &v1, sizeof(v1)) != crc)
+        return false;
+    memset(ckpt, 0, sizeof(*ckpt));
+    ckpt->max_queue_size = v1.max_queue_size;
+    ckpt->seq[0] = v1.seq;
+    ckpt->off = v1.off;
+    return true;
+}
+
+/* only heavy_job and load touch the marks */
+static void asyncmsg_mark_chunk(struct asyncmsg_persist *p, u64 off, const u64 *max_seq,
+                                unsigned int lanes)
+{
+    /* out of marks: fold the newest two, the result is coarser but still safe */
+    if (p->nr_marks == PERSIST_MARKS)
     {
-        return 0;
+        struct asyncmsg_mark *m = &p->marks[PERSIST_MARKS - 2];
+
+        for (int i = 0; i < ASYNC_MSG_PRIO_LEVELS; i++)
+            m->max_seq[i] = max(m->max_seq[i], p->marks[PERSIST_MARKS - 1].max_seq[i]);
+        m->lanes |= p->marks[PERSIST_MARKS - 1].lanes;
+        p->nr_marks--;
+    }
+    p->marks[p->nr_marks].off = off;
+    memcpy(p->marks[p->nr_marks].max_seq, max_seq, sizeof(p->marks[0].max_seq));
+    p->marks[p->nr_marks].lanes = lanes;
+    p->nr_marks++;
+}
+
+/*
+ * true when every lane's records in the chunk are below its checkpoint.
+ * Lanes without records are left out, a zero max_seq is a real seq of lane 0.
+ */
+static bool asyncmsg_mark_done(const struct asyncmsg_mark *m, const u64 *ckpt_seq)
+{
+    for (int i = 0; i < ASYNC_MSG_PRIO_LEVELS; i++)
+        if ((m->lanes & (1U << i)) && m->max_seq[i] >= ckpt_seq[i])
+            return false;
+    return true;
+}
+
+/* first log offset that may still hold a record with seq >= ckpt_seq of its lane */
+static u64 asyncmsg_safe_off(struct asyncmsg_persist *p, const u64 *ckpt_seq)
+{
+    int drop = 0;
+
+    while (drop < p->nr_marks && asyncmsg_mark_done(&p->marks[drop], ckpt_seq))
+        drop++;
+    if (drop)
+    {
+        p->nr_marks -= drop;
+        memmove(p->marks, p->marks + drop, p->nr_marks * sizeof(p->marks[0]));
     }
-    else if(ret < 0)
+    return p->nr_marks ? p->marks[0].off : p->log_end;
+}
+
+static void asyncmsg_work_fn(struct work_struct *work)
+{
+    struct asyncmsg_dev *dev = container_of(to_delayed_work(work), struct asyncmsg_dev, heavy_job);
+    struct asyncmsg_persist *p = &dev->persist;
+    u64 serving, ckpt_seq[ASYNC_MSG_PRIO_LEVELS];
+    u64 flushed = 0;
+    bool ckpt, sync;
+    int cpu;
+
+    /*
+     * Checkpoint and sync request are read before any stage is swapped, so
+     * every record they cover is written in this pass.
+     */
+    spin_lock(&p->lock);
+    serving = p->sync_req;
+    sync = serving > p->durable_gen;
+    ckpt = p->ckpt_dirty;
+    memcpy(ckpt_seq, p->ckpt_seq, sizeof(ckpt_seq));
+    p->ckpt_dirty = false;
+    spin_unlock(&p->lock);
+
+    for_each_possible_cpu(cpu)
     {
-        return -EFAULT;
+        struct asyncmsg_stage *st = per_cpu_ptr(p->stages, cpu);
+        loff_t pos = 0;
+        size_t len;
+        u64 max_seq[ASYNC_MSG_PRIO_LEVELS];
+        unsigned int lanes;
+        char *buf;
+
+        spin_lock(&st->lock);
+        len = st->len;
+        memcpy(max_seq, st->max_seq, sizeof(max_seq));
+        lanes = st->lanes;
+        if (len)
+        {
+            buf = st->buf;
+            st->buf = p->flush_buf;
+            p->flush_buf = buf;
+            st->len = 0;
+            memset(st->max_seq, 0, sizeof(st->max_seq));
+            st->lanes = 0;
+        }
+        spin_unlock(&st->lock);
+
+        if (!len)
+            continue;
+
+        if (p->log_file)
+            kernel_write(p->log_file, p->flush_buf, len, &pos);
+        asyncmsg_mark_chunk(p, p->log_end, max_seq, lanes);
+        p->log_end += len;
+        flushed += len;
     }
+    trace_asyncmsg_persist_flush(dev->index, flushed, p->log_end, sync, ckpt || sync);
 
-    if(down_interruptible(&dev->sem))
+    /* producers stuck on a full stage can go on */
+    wake_up_all(&p->flush_q);
+
+    if (sync && p->log_file)
     {
-        return -ERESTARTSYS;
+        vfs_fsync(p->log_file, 1);
+    }
+    if ((ckpt || sync) && p->ckpt_file)
+    {
+        write_checkpoint(dev, ckpt_seq, asyncmsg_safe_off(p, ckpt_seq));
+        if (sync)
+            vfs_fsync(p->ckpt_file, 1);
     }
 
-    if (dev->head >= dev->tail)
+    if (sync)
     {
-        up(&dev->sem);
-        return 0;
-    }   
+        spin_lock(&p->lock);
+        p->durable_gen = serving;
+        spin_unlock(&p->lock);
+        wake_up_all(&p->flush_q);
+    }
+}
 
-    struct async_msg *curr_msg = dev->queue[dev->head];
-    curr_msg->processed = true;
+/* ASYNC_MSG_SYNC: waits until everything staged before the call is on disk */
+static int asyncmsg_persist_sync(struct asyncmsg_dev *dev)
+{
+    struct asyncmsg_persist *p = &dev->persist;
+    u64 target;
 
-    len = snprintf(tmp, sizeof(tmp),
-        "message: %.*s\nlen: %ld\ntimestamp_ns: %lld\nprocessed: %d\n",
-        (int)curr_msg->len, curr_msg->msg,
-        curr_msg->len,
-        curr_msg->timestamp_ns,
-        curr_msg->processed);
+    spin_lock(&p->lock);
+    target = ++p->sync_req;
+    spin_unlock(&p->lock);
+
+    asyncmsg_persist_kick(dev, true);
+    return wait_event_interruptible(p->flush_q, READ_ONCE(p->durable_gen) >= target);
+}
+
+static bool asyncmsg_log_rec_ok(const struct asyncmsg_log_rec *rec, const u64 *gen,
+                                const char *payload, size_t avail)
+{
+    if ((rec->magic != ASYNCMSG_LOG_MAGIC && rec->magic != ASYNCMSG_LOG_MAGIC_KEYED) ||
+        rec->len > MAX_MSG_LEN || rec->len > avail)
+        return false;
+    return asyncmsg_log_crc(rec, gen, payload) == rec->crc;
+}
+
+/* a replayed record; gen orders the values compaction logged under one seq */
+struct asyncmsg_backlog {
+    struct async_msg msg;
+    u64 gen;
+};
+
+/* by seq, a message compacted in place comes after the values it replaced */
+static int asyncmsg_seq_cmp(const void *a, const void *b)
+{
+    const struct asyncmsg_backlog *x = a, *y = b;
+
+    if (x->msg.seq != y->msg.seq)
+        return x->msg.seq < y->msg.seq ? -1 : 1;
+    if (x->gen == y->gen)
+        return 0;
+    return x->gen < y->gen ? -1 : 1;
+}
+
+/* collects one unconsumed record, growing the backlog array as needed */
+static int asyncmsg_backlog_add(struct asyncmsg_backlog **backlog, unsigned int *n, unsigned int *cap,
+                                const struct asyncmsg_log_rec *rec, u64 gen, const char *payload)
+{
+    struct async_msg *msg;
 
-    if (copy_to_user(buf, tmp, len))
+    if (*n == *cap)
     {
-        up(&dev->sem);
-        return -EFAULT;
+        unsigned int new_cap = *cap ? *cap * 2 : MAX_QUEUE_SIZE;
+        struct asyncmsg_backlog *grown;
+
+        new_cap = min(new_cap, PERSIST_BACKLOG_MAX);
+        grown = kvmalloc_array(new_cap, sizeof(*grown), GFP_KERNEL);
+        if (!grown)
+            return -ENOMEM;
+        if (*backlog)
+        {
+            memcpy(grown, *backlog, *n * sizeof(*grown));
+            kvfree(*backlog);
+        }
+        *backlog = grown;
+        *cap = new_cap;
     }
 
-    dev->head++;
-    dev->free_messages--;
-    *ppos += len;
-    up(&dev->sem);
-    wake_up(&dev->write_q);
-    
-    save_meta_db(dev);
+    msg = &(*backlog)[*n].msg;
+    if (asyncmsg_msg_fill(msg, payload, rec->len))
+        return -ENOMEM;
+    (*backlog)[*n].gen = gen;
+    (*n)++;
+    msg->timestamp_ns = rec->timestamp_ns;
+    msg->ttl_ms = rec->ttl_ms;
+    msg->seq = rec->seq;
+    msg->processed = false;
+    msg->classified = false;
+    msg->redelivered = false;
+    msg->expired = false;
+    msg->keyed = rec->magic == ASYNCMSG_LOG_MAGIC_KEYED;
+    return 0;
+}
 
-    return len;
+/*
+ * Sorts the backlog, keeps only the highest gen of every seq and then the
+ * oldest limit messages of every lane. Returns how many it dropped beyond
+ * the limit, duplicates do not count as lost.
+ */
+static unsigned int asyncmsg_backlog_trim(struct asyncmsg_backlog *backlog, unsigned int *n,
+                                          unsigned int *lane_n, unsigned int limit)
+{
+    unsigned int kept[ASYNC_MSG_PRIO_LEVELS] = { };
+    unsigned int j = 0, lost = 0;
+
+    sort(backlog, *n, sizeof(*backlog), asyncmsg_seq_cmp, NULL);
+    for (unsigned int i = 0; i < *n; i++)
+    {
+        unsigned int l = ASYNCMSG_SEQ_LANE(backlog[i].msg.seq);
+
+        /* compaction logs a message again under its seq, the highest gen wins */
+        if (i + 1 < *n && backlog[i + 1].msg.seq == backlog[i].msg.seq)
+        {
+            asyncmsg_msg_free(&backlog[i].msg);
+            continue;
+        }
+        if (kept[l] == limit)
+        {
+            asyncmsg_msg_free(&backlog[i].msg);
+            lost++;
+            continue;
+        }
+        kept[l]++;
+        backlog[j++] = backlog[i];
+    }
+    *n = j;
+    memcpy(lane_n, kept, sizeof(kept));
+    return lost;
 }
 
-static ssize_t asyncmsg_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+/*
+ * Rebuilds the unconsumed part of the queue. Scanning starts at the
+ * checkpoint, so load time follows the backlog and not the log's history.
+ * Records from different CPUs interleave in the log, so the backlog is sorted
+ * by seq before it goes into the rings; the lane in the top bits of seq
+ * groups it by lane at the same time. A torn or corrupt tail left by a crash
+ * is cut off so appends stay readable.
+ */
+static void asyncmsg_log_recover(struct asyncmsg_dev *dev)
 {
-    char tmp[MAX_MSG_LEN];
-    struct asyncmsg_dev *dev = file->private_data;
-    unsigned long curr_jiffies = jiffies;
-    unsigned long new_interval;
-    int ret;
-    struct async_msg *new_mess;
+    struct asyncmsg_persist *p = &dev->persist;
+    struct asyncmsg_ckpt ckpt;
+    struct asyncmsg_backlog *backlog = NULL;
+    unsigned int n = 0, cap = 0, lost = 0, first = 0;
+    unsigned int lane_n[ASYNC_MSG_PRIO_LEVELS] = { };
+    u64 max_seq[ASYNC_MSG_PRIO_LEVELS] = { };
+    bool seen[ASYNC_MSG_PRIO_LEVELS] = { };
+    unsigned int most = 0;
+    char *buf = p->flush_buf;
+    size_t have = 0, used = 0;
+    loff_t size, start, pos, rpos;
+    bool eof = false;
 
-    /* 1. Читаємо дані від користувача ОДРАЗУ, до всіх перевірок */
-    count = min((size_t)(MAX_MSG_LEN - 1), count);
-    if(copy_from_user(tmp, buf, count))
+    if (!read_checkpoint(dev, &ckpt))
+        memset(&ckpt, 0, sizeof(ckpt));
+    for (int i = 0; i < ASYNC_MSG_PRIO_LEVELS; i++)
+        ckpt.seq[i] = max(ckpt.seq[i], (u64)i << ASYNCMSG_LANE_SHIFT);
+
+    if (ckpt.max_queue_size > 0 && ckpt.max_queue_size < MAX_QUEUE_LIMIT &&
+        ckpt.max_queue_size != dev->max_queue_size)
+        asyncmsg_resize(dev, ckpt.max_queue_size);
+
+    size = i_size_read(file_inode(p->log_file));
+    start = min_t(loff_t, ckpt.off, size);
+    pos = start;
+    rpos = start;
+
+    for (;;)
     {
-        return -EFAULT;
+        struct asyncmsg_log_rec rec;
+        const char *payload;
+        unsigned int lane;
+        size_t hdr;
+        u64 gen = 0;
+        ssize_t got;
+
+        if (!eof && have - used < sizeof(struct asyncmsg_log_rec_keyed) + MAX_MSG_LEN)
+        {
+            memmove(buf, buf + used, have - used);
+            have -= used;
+            used = 0;
+            got = kernel_read(p->log_file, buf + have, PERSIST_STAGE_SIZE - have, &rpos);
+            if (got <= 0)
+                eof = true;
+            else
+                have += got;
+        }
+        if (have - used < sizeof(rec))
+            break;
+
+        memcpy(&rec, buf + used, sizeof(rec));
+        hdr = sizeof(rec);
+        if (rec.magic == ASYNCMSG_LOG_MAGIC_KEYED)
+        {
+            hdr = sizeof(struct asyncmsg_log_rec_keyed);
+            if (have - used < hdr)
+                break;
+            memcpy(&gen, buf + used + sizeof(rec), sizeof(gen));
+        }
+        payload = buf + used + hdr;
+        if (!asyncmsg_log_rec_ok(&rec, hdr > sizeof(rec) ? &gen : NULL, payload, have - used - hdr))
+            break;
+
+        used += hdr + rec.len;
+        pos += hdr + rec.len;
+        if (gen > atomic64_read(&p->key_gen))
+            atomic64_set(&p->key_gen, gen);
+        lane = ASYNCMSG_SEQ_LANE(rec.seq);
+        if (lane >= ASYNC_MSG_PRIO_LEVELS)
+        {
+            lost++;
+            continue;
+        }
+        if (!seen[lane] || rec.seq > max_seq[lane])
+            max_seq[lane] = rec.seq;
+        seen[lane] = true;
+        if (rec.seq < ckpt.seq[lane])
+            continue;
+
+        if (n == PERSIST_BACKLOG_MAX)
+            lost += asyncmsg_backlog_trim(backlog, &n, lane_n, MAX_QUEUE_LIMIT);
+        if (asyncmsg_backlog_add(&backlog, &n, &cap, &rec, gen, payload))
+            lost++;
     }
-    tmp[count] = '\0';
 
-    /* Перевіряємо чи це не команда зміни інтервалу */
-    if(sscanf(tmp, "interval=%lu", &new_interval) == 1)
+    if (pos < size)
     {
-        if(down_interruptible(&dev->sem)) return -ERESTARTSYS;
-        dev->write_delay_ms = new_interval;
-        dev->last_jiffies = curr_jiffies;
-        printk(KERN_INFO "asyncmsg: set interval to %lu ms \n", new_interval);
-        up(&dev->sem);
-        return count;
+        printk(KERN_WARNING "asyncmsg%d: dropping %lld bytes of torn log tail\n", dev->index, size - pos);
+        vfs_truncate(&p->log_file->f_path, pos);
+    }
+
+    lost += asyncmsg_backlog_trim(backlog, &n, lane_n, MAX_QUEUE_LIMIT);
+    for (int l = 0; l < ASYNC_MSG_PRIO_LEVELS; l++)
+        most = max(most, lane_n[l]);
+    if (most > dev->max_queue_size)
+        asyncmsg_resize(dev, most);
+
+    for (int l = 0; l < ASYNC_MSG_PRIO_LEVELS; l++)
+    {
+        struct asyncmsg_lane *lane = &dev->lanes[l];
+        unsigned int k = lane_n[l];
+        u64 next_seq;
+
+        if (k > dev->max_queue_size)
+        {
+            lost += k - dev->max_queue_size;
+            for (unsigned int i = dev->max_queue_size; i < k; i++)
+                asyncmsg_msg_free(&backlog[first + i].msg);
+            k = dev->max_queue_size;
+        }
+        /* the log may skip seqs, so checkpoints must not count from seq_base here */
+        if (k)
+        {
+            lane->replay_seq = kvmalloc_array(k, sizeof(u64), GFP_KERNEL);
+            if (!lane->replay_seq)
+            {
+                lost += k;
+                for (unsigned int i = 0; i < k; i++)
+                    asyncmsg_msg_free(&backlog[first + i].msg);
+                k = 0;
+            }
+        }
+        for (unsigned int i = 0; i < k; i++)
+        {
+            struct async_msg *slot = asyncmsg_slot(lane, i);
+
+            *slot = backlog[first + i].msg;
+            slot->ready = i + 1;
+            lane->replay_seq[i] = slot->seq;
+        }
+        lane->replay_end = k;
+        first += lane_n[l];
+
+        /* new messages continue above everything the log has ever seen */
+        next_seq = seen[l] ? max(max_seq[l] + 1, ckpt.seq[l]) : ckpt.seq[l];
+        atomic64_set(&lane->head, 0);
+        atomic64_set(&lane->tail, k);
+        lane->seq_base = next_seq - k;
+        lane_n[l] = k;
+    }
+    kvfree(backlog);
+
+    p->log_end = pos;
+    memcpy(p->ckpt_seq, ckpt.seq, sizeof(p->ckpt_seq));
+    if (n)
+    {
+        unsigned int lanes = 0;
+
+        for (int l = 0; l < ASYNC_MSG_PRIO_LEVELS; l++)
+            if (seen[l])
+                lanes |= 1U << l;
+        asyncmsg_mark_chunk(p, start, max_seq, lanes);
     }
 
-    /* 2. Якщо черга жорстко переповнена - пишемо в DLQ і виходимо */
-    if (dev->tail >= dev->max_queue_size)
+    n = 0;
+    for (int l = 0; l < ASYNC_MSG_PRIO_LEVELS; l++)
+        n += lane_n[l];
+    if (n || lost)
+        printk(KERN_INFO "asyncmsg%d: replayed %u messages from log, %u did not fit\n",
+               dev->index, n, lost);
+}
+
+static int asyncmsg_persist_init(struct asyncmsg_dev *dev)
+{
+    struct asyncmsg_persist *p = &dev->persist;
+    int cpu;
+
+    spin_lock_init(&p->lock);
+    init_waitqueue_head(&p->flush_q);
+
+    p->stages = alloc_percpu(struct asyncmsg_stage);
+    p->flush_buf = kvmalloc(PERSIST_STAGE_SIZE, GFP_KERNEL);
+    if (!p->stages || !p->flush_buf)
+        goto fail;
+    for_each_possible_cpu(cpu)
+    {
+        struct asyncmsg_stage *st = per_cpu_ptr(p->stages, cpu);
+
+        spin_lock_init(&st->lock);
+        st->buf = kvmalloc(PERSIST_STAGE_SIZE, GFP_KERNEL);
+        if (!st->buf)
+            goto fail;
+    }
+
+    /* O_APPEND гарантує, що нові записи будуть додаватись в кінець */
+    p->log_file = filp_open(dev->log_path, O_RDWR | O_CREAT | O_APPEND | O_LARGEFILE, 0666);
+    if (IS_ERR(p->log_file)) {
+        printk(KERN_ERR "asyncmsg%d: failed to open log file\n", dev->index);
+        p->log_file = NULL;
+    }
+
+    p->ckpt_file = filp_open(dev->ckpt_path, O_RDWR | O_CREAT, 0666);
+    if (IS_ERR(p->ckpt_file)) {
+        printk(KERN_ERR "asyncmsg%d: failed to open checkpoint file\n", dev->index);
+        p->ckpt_file = NULL;
+    }
+
+    if (p->log_file && p->ckpt_file)
+        asyncmsg_log_recover(dev);
+
+    INIT_DELAYED_WORK(&dev->heavy_job, asyncmsg_work_fn);
+    return 0;
+
+fail:
+    if (p->stages)
+    {
+        for_each_possible_cpu(cpu)
+            kvfree(per_cpu_ptr(p->stages, cpu)->buf);
+        free_percpu(p->stages);
+    }
+    kvfree(p->flush_buf);
+    return -ENOMEM;
+}
+
+/* called with no writers left: pushes out whatever is still staged and closes the files */
+static void asyncmsg_persist_exit(struct asyncmsg_dev *dev)
+{
+    struct asyncmsg_persist *p = &dev->persist;
+    int cpu;
+
+    p->sync_req++;
+    mod_delayed_work(dev->wq, &dev->heavy_job, 0);
+    flush_delayed_work(&dev->heavy_job);
+    cancel_delayed_work_sync(&dev->heavy_job);
+
+    if (p->log_file)
+        filp_close(p->log_file, NULL);
+    if (p->ckpt_file)
+        filp_close(p->ckpt_file, NULL);
+    for_each_possible_cpu(cpu)
+        kvfree(per_cpu_ptr(p->stages, cpu)->buf);
+    free_percpu(p->stages);
+    kvfree(p->flush_buf);
+}
+
+/* messages from one write: a single raw payload or a run of framed records */
+struct asyncmsg_batch {
+    const char *buf;
+    size_t len;
+    unsigned int n;
+    bool framed;
+    /* per message, a size-class buffer already holding the payload; enqueue takes ownership */
+    char **ext;
+    /* ASYNC_MSG_DLQ_REPLAY: a rejected message stays where it came from */
+    bool replay;
+    /* a full lane gives -EAGAIN without the DLQ, the caller waits for room itself */
+    bool will_wait;
+    /* the lane every message of the batch goes to */
+    unsigned int prio;
+    /* some record has ASYNC_MSG_REC_KEY */
+    bool keys;
+    /* out: position of the first message queued */
+    u64 pos;
+    /* mmap tx: checked headers, payloads still in the shared ring; off counts messages */
+    const struct asyncmsg_frame *frames;
+};
+
+static const struct asyncmsg_rec *asyncmsg_batch_rec(const struct asyncmsg_batch *b, size_t off)
+{
+    if (b->frames)
+        return &b->frames[off].rec;
+    return (const struct asyncmsg_rec *)(b->buf + off);
+}
+
+/* returns the payload at *off and moves *off to the next message */
+static const char *asyncmsg_batch_next(const struct asyncmsg_batch *b, size_t *off, u32 *len)
+{
+    const struct asyncmsg_rec *rec;
+
+    if (b->frames)
+    {
+        *len = b->frames[*off].rec.len;
+        return b->frames[(*off)++].data;
+    }
+    if (!b->framed)
+    {
+        *len = b->len;
+        return b->buf;
+    }
+    rec = (const struct asyncmsg_rec *)(b->buf + *off);
+    *len = rec->len;
+    *off += ASYNC_MSG_REC_SIZE(rec->len);
+    return (const char *)(rec + 1);
+}
+
+/* TTL of the message at off: its record's with ASYNC_MSG_REC_TTL, def otherwise */
+static u32 asyncmsg_batch_ttl(const struct asyncmsg_batch *b, size_t off, u32 def)
+{
+    const struct asyncmsg_rec *rec;
+
+    if (!b->framed)
+        return def;
+    rec = asyncmsg_batch_rec(b, off);
+    if (!(rec->flags & ASYNC_MSG_REC_TTL))
+        return def;
+    return min_t(u64, rec->timestamp_ns, U32_MAX);
+}
+
+static bool asyncmsg_batch_keyed(const struct asyncmsg_batch *b, size_t off)
+{
+    return b->framed && (asyncmsg_batch_rec(b, off)->flags & ASYNC_MSG_REC_KEY);
+}
+
+/*
+ * Copies the payload of message i, which batch_next() returned as data.
+ * Userspace may rewrite a shared ring meanwhile, so a keyed copy gets the
+ * key that was read when the batch was checked.
+ */
+static void asyncmsg_batch_copy(const struct asyncmsg_batch *b, unsigned int i, char *dst,
+                                const char *data, u32 len)
+{
+    memcpy(dst, data, len);
+    if (b->frames && (b->frames[i].rec.flags & ASYNC_MSG_REC_KEY))
+        memcpy(dst, &b->frames[i].key, ASYNC_MSG_KEY_SIZE);
+}
+
+/*
+ * Copies framed payloads that do not fit in a slot into their size-class
+ * buffers before any slot is reserved, so a failed allocation never leaves a
+ * reserved slot unfilled.
+ */
+static int asyncmsg_batch_prepare(struct asyncmsg_batch *b)
+{
+    size_t off = 0;
+
+    b->ext = NULL;
+    for (unsigned int i = 0; i < b->n; i++)
+    {
+        u32 len;
+        const char *data = asyncmsg_batch_next(b, &off, &len);
+
+        if (len <= MSG_INLINE_LEN)
+            continue;
+        if (!b->ext)
+        {
+            b->ext = kvcalloc(b->n, sizeof(*b->ext), GFP_KERNEL);
+            if (!b->ext)
+                return -ENOMEM;
+        }
+        b->ext[i] = asyncmsg_payload_alloc(len);
+        if (!b->ext[i])
+            return -ENOMEM;
+        asyncmsg_batch_copy(b, i, b->ext[i], data, len);
+    }
+    return 0;
+}
+
+/* frees what enqueue did not take */
+static void asyncmsg_batch_release(struct asyncmsg_batch *b)
+{
+    size_t off = 0;
+
+    if (!b->ext)
+        return;
+    for (unsigned int i = 0; i < b->n; i++)
+    {
+        u32 len;
+
+        asyncmsg_batch_next(b, &off, &len);
+        asyncmsg_payload_free(b->ext[i], len);
+    }
+    kvfree(b->ext);
+}
+
+static const char * const asyncmsg_dlq_reasons[] = {
+    [ASYNC_MSG_DLQ_QUEUE_FULL] = "queue_full_hard_limit",
+    [ASYNC_MSG_DLQ_WAIT_TIMEOUT] = "wait_timeout",
+    [ASYNC_MSG_DLQ_LEASE_LOST] = "lease_lost",
+    [ASYNC_MSG_DLQ_EXPIRED] = "expired",
+};
+
+/* adds one dead letter, the oldest one goes when the ring is full */
+static void asyncmsg_dlq_push(struct asyncmsg_dlq *dlq, const struct asyncmsg_dlq_ent *ent)
+{
+    spin_lock(&dlq->lock);
+    if (dlq->tail - dlq->head == ASYNCMSG_DLQ_SIZE)
+    {
+        struct asyncmsg_dlq_ent *old = &dlq->ents[dlq->head & (ASYNCMSG_DLQ_SIZE - 1)];
+
+        asyncmsg_payload_free(old->data, old->len);
+        dlq->head++;
+        if (dlq->spill < dlq->head)
+            dlq->spill = dlq->head;
+        dlq->dropped++;
+    }
+    dlq->ents[dlq->tail & (ASYNCMSG_DLQ_SIZE - 1)] = *ent;
+    dlq->tail++;
+    spin_unlock(&dlq->lock);
+}
+
+/*
+ * Takes the oldest dead letter out of the ring, *pos is where it was.
+ * *spilled tells whether it already made it to the file, so that
+ * asyncmsg_dlq_unpop can restore it.
+ */
+static bool asyncmsg_dlq_pop(struct asyncmsg_dlq *dlq, struct asyncmsg_dlq_ent *ent,
+                             u64 *pos, bool *spilled)
+{
+    spin_lock(&dlq->lock);
+    if (dlq->head == dlq->tail)
+    {
+        spin_unlock(&dlq->lock);
+        return false;
+    }
+    *ent = dlq->ents[dlq->head & (ASYNCMSG_DLQ_SIZE - 1)];
+    *pos = dlq->head;
+    *spilled = dlq->spill > dlq->head;
+    dlq->head++;
+    if (dlq->spill < dlq->head)
+        dlq->spill = dlq->head;
+    spin_unlock(&dlq->lock);
+    return true;
+}
+
+/* puts back what asyncmsg_dlq_pop took, unless newer letters filled the ring */
+static void asyncmsg_dlq_unpop(struct asyncmsg_dlq *dlq, const struct asyncmsg_dlq_ent *ent, bool spilled)
+{
+    spin_lock(&dlq->lock);
+    if (dlq->tail - dlq->head == ASYNCMSG_DLQ_SIZE)
+    {
+        dlq->dropped++;
+        spin_unlock(&dlq->lock);
+        asyncmsg_payload_free(ent->data, ent->len);
+        return;
+    }
+    dlq->head--;
+    dlq->ents[dlq->head & (ASYNCMSG_DLQ_SIZE - 1)] = *ent;
+    if (!spilled)
+        dlq->spill = dlq->head;
+    spin_unlock(&dlq->lock);
+}
+
+/*
+ * Rejected messages of a batch go into the in-memory DLQ ring. The writer
+ * only copies them, the file is written later by asyncmsg_dlq_spill.
+ */
+static void save_to_dlq_db(struct asyncmsg_dev *dev, const struct asyncmsg_batch *b,
+                           unsigned int first, u32 reason)
+{
+    struct asyncmsg_dlq_ent ent = { .timestamp_ns = ktime_get_ns(), .reason = reason, .prio = b->prio };
+    size_t off = 0;
+
+    if (b->replay)
+        return;
+    this_cpu_add(dev->stats->dlq[reason - 1], b->n - first);
+    trace_asyncmsg_dlq_reject(dev->index, reason, b->n - first);
+    /* older messages of a big batch would only push each other out */
+    if (b->n - first > ASYNCMSG_DLQ_SIZE)
+    {
+        spin_lock(&dev->dlq.lock);
+        dev->dlq.dropped += b->n - first - ASYNCMSG_DLQ_SIZE;
+        spin_unlock(&dev->dlq.lock);
+        first = b->n - ASYNCMSG_DLQ_SIZE;
+    }
+
+    for (unsigned int i = 0; i < b->n; i++)
+    {
+        const char *msg_text = asyncmsg_batch_next(b, &off, &ent.len);
+
+        if (i < first)
+            continue;
+
+        ent.data = asyncmsg_payload_alloc(ent.len);
+        if (!ent.data)
+        {
+            spin_lock(&dev->dlq.lock);
+            dev->dlq.dropped++;
+            spin_unlock(&dev->dlq.lock);
+            continue;
+        }
+        memcpy(ent.data, msg_text, ent.len);
+        asyncmsg_dlq_push(&dev->dlq, &ent);
+    }
+    queue_work(dev->wq, &dev->dlq.spill_work);
+}
+
+/*
+ * Appends the dead letters that are not on disk yet to the DLQ file. Lines
+ * are formatted under the lock into a bounce buffer and written after it is
+ * dropped, a chunk at a time.
+ */
+static void asyncmsg_dlq_spill(struct work_struct *work)
+{
+    struct asyncmsg_dev *dev = container_of(work, struct asyncmsg_dev, dlq.spill_work);
+    struct asyncmsg_dlq *dlq = &dev->dlq;
+    struct file *f;
+    loff_t pos = 0;
+    char *buf;
+    size_t len;
+
+    buf = kvmalloc(ASYNCMSG_DLQ_SPILL_BUF, GFP_KERNEL);
+    if (!buf)
+        return;
+    /* letters stay in memory if the file cannot be opened, readers can still drain them */
+    f = filp_open(dev->dlq_path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (IS_ERR(f))
+    {
+        kvfree(buf);
+        return;
+    }
+
+    do
+    {
+        len = 0;
+        spin_lock(&dlq->lock);
+        while (dlq->spill != dlq->tail && ASYNCMSG_DLQ_SPILL_BUF - len >= ASYNCMSG_DLQ_LINE)
+        {
+            const struct asyncmsg_dlq_ent *e = &dlq->ents[dlq->spill & (ASYNCMSG_DLQ_SIZE - 1)];
+            char *p = buf + len, *end = p + ASYNCMSG_DLQ_LINE;
+
+            /* the payload is arbitrary bytes, only its hex is safe inside a JSON string */
+            p += scnprintf(p, end - p,
+                "{\"entity\": \"dead_letter\", \"timestamp_ns\": %llu, \"len\": %u, \"msg_hex\": \"",
+                e->timestamp_ns, e->len);
+            p = bin2hex(p, e->data, min_t(u32, e->len, ASYNCMSG_DLQ_HEX));
+            p += scnprintf(p, end - p, "\", \"reason\": \"%s\", \"prio\": %u}\n",
+                           asyncmsg_dlq_reasons[e->reason], e->prio);
+            len = p - buf;
+            dlq->spill++;
+        }
+        spin_unlock(&dlq->lock);
+        if (len)
+            kernel_write(f, buf, len, &pos);
+    } while (len);
+
+    filp_close(f, NULL);
+    kvfree(buf);
+}
+
+static int asyncmsg_dlq_init(struct asyncmsg_dev *dev)
+{
+    spin_lock_init(&dev->dlq.lock);
+    INIT_WORK(&dev->dlq.spill_work, asyncmsg_dlq_spill);
+    dev->dlq.ents = kcalloc(ASYNCMSG_DLQ_SIZE, sizeof(*dev->dlq.ents), GFP_KERNEL);
+    return dev->dlq.ents ? 0 : -ENOMEM;
+}
+
+/* spills whatever is still pending, then drops the ring */
+static void asyncmsg_dlq_exit(struct asyncmsg_dev *dev)
+{
+    struct asyncmsg_dlq *dlq = &dev->dlq;
+
+    flush_work(&dlq->spill_work);
+    for (u64 pos = dlq->head; pos != dlq->tail; pos++)
+    {
+        struct asyncmsg_dlq_ent *e = &dlq->ents[pos & (ASYNCMSG_DLQ_SIZE - 1)];
+
+        asyncmsg_payload_free(e->data, e->len);
+    }
+    kfree(dlq->ents);
+}
+
+static int culc_free_space(struct asyncmsg_dev *dev, struct asyncmsg_lane *lane)
+{
+    int used = asyncmsg_lane_count(lane);
+
+    return (used < dev->max_queue_size) ? (dev->max_queue_size - used) : 0;
+}
+
+/* slots are allocated for a power of two so wraparound is a mask, not a division */
+static struct async_msg *asyncmsg_ring_alloc(int size, unsigned int *mask)
+{
+    unsigned int slots = roundup_pow_of_two(size);
+    struct async_msg *ring;
+
+    ring = kvcalloc(slots, sizeof(struct async_msg), GFP_KERNEL);
+    if (ring)
+        *mask = slots - 1;
+    return ring;
+}
+
+/*
+ * Reserves up to n consecutive positions for a producer without taking any
+ * lock and returns how many it got. Consumers free slots strictly in order,
+ * so once pos + k - head fits in max_queue_size every reserved slot is
+ * already released. Caller holds resize_sem for read.
+ */
+static int asyncmsg_reserve(struct asyncmsg_dev *dev, struct asyncmsg_lane *lane,
+                            unsigned int n, u64 *pos)
+{
+    s64 tail = atomic64_read(&lane->tail);
+    s64 room;
+    unsigned int k;
+
+    do {
+        room = dev->max_queue_size - (tail - atomic64_read_acquire(&lane->head));
+        if (room <= 0)
+            return -ENOSPC;
+        k = min_t(s64, n, room);
+    } while (!atomic64_try_cmpxchg(&lane->tail, &tail, tail + k));
+
+    *pos = tail;
+    return k;
+}
+
+/* makes a filled slot visible to consumers, pairs with asyncmsg_head_ready() */
+static inline void asyncmsg_publish(struct async_msg *slot, u64 pos)
+{
+    smp_store_release(&slot->ready, (u32)(pos + 1));
+}
+
+/* stops producers and consumers, everything reserved is published once this returns */
+static int asyncmsg_lock_all(struct asyncmsg_dev *dev)
+{
+    if (down_interruptible(&dev->sem))
+        return -ERESTARTSYS;
+    percpu_down_write(&dev->resize_sem);
+    return 0;
+}
+
+static void asyncmsg_unlock_all(struct asyncmsg_dev *dev)
+{
+    percpu_up_write(&dev->resize_sem);
+    up(&dev->sem);
+}
+
+/*
+ * Moves the queued messages of every lane into a ring of new_size slots
+ * keeping their order. Refuses to shrink a lane below the number of messages
+ * it still holds.
+ */
+static int asyncmsg_resize(struct asyncmsg_dev *dev, int new_size)
+{
+    struct async_msg *ring[ASYNC_MSG_PRIO_LEVELS] = { }, *old[ASYNC_MSG_PRIO_LEVELS];
+    unsigned int mask, i;
+    unsigned long flags;
+    int l, err = 0;
+
+    for (l = 0; l < ASYNC_MSG_PRIO_LEVELS; l++)
+    {
+        ring[l] = asyncmsg_ring_alloc(new_size, &mask);
+        if (!ring[l])
+            err = -ENOMEM;
+    }
+    if (!err)
+        err = asyncmsg_lock_all(dev);
+    if (err)
+        goto out;
+
+    for (l = 0; l < ASYNC_MSG_PRIO_LEVELS; l++)
+    {
+        if (asyncmsg_lane_count(&dev->lanes[l]) > new_size)
+        {
+            asyncmsg_unlock_all(dev);
+            err = -EBUSY;
+            goto out;
+        }
+    }
+
+    for (l = 0; l < ASYNC_MSG_PRIO_LEVELS; l++)
+    {
+        struct asyncmsg_lane *lane = &dev->lanes[l];
+        u64 head = atomic64_read(&lane->head);
+        u64 tail = atomic64_read(&lane->tail);
+
+        /* a fresh slot must never look published for a position ahead of head */
+        for (i = 0; i <= mask; i++)
+            ring[l][i].ready = (u32)head;
+        for (u64 pos = head; pos != tail; pos++)
+            ring[l][pos & mask] = *asyncmsg_slot(lane, pos);
+    }
+
+    /* release_slots walks the rings under the spinlock, so swap them there */
+    spin_lock_irqsave(&dev->lock, flags);
+    for (l = 0; l < ASYNC_MSG_PRIO_LEVELS; l++)
+    {
+        old[l] = dev->lanes[l].queue;
+        dev->lanes[l].queue = ring[l];
+        dev->lanes[l].ring_mask = mask;
+        ring[l] = old[l];
+    }
+    dev->max_queue_size = new_size;
+    spin_unlock_irqrestore(&dev->lock, flags);
+
+    asyncmsg_unlock_all(dev);
+    wake_up_all(&dev->write_q);
+out:
+    /* the old rings on success, the unused new ones otherwise */
+    for (l = 0; l < ASYNC_MSG_PRIO_LEVELS; l++)
+        kvfree(ring[l]);
+    return err;
+}
+
+static bool asyncmsg_contains(const char *data, u32 len, const u8 *pat, u32 plen)
+{
+    const char *p = data, *end = data + len;
+
+    while (end - p >= plen)
+    {
+        p = memchr(p, pat[0], end - p - plen + 1);
+        if (!p)
+            return false;
+        if (!memcmp(p, pat, plen))
+            return true;
+        p++;
+    }
+    return false;
+}
+
+/* a filter that can only pass messages by, which takes fan-out mode */
+static bool asyncmsg_filter_skips(const struct asyncmsg_filter *f)
+{
+    return (f->flags & (ASYNC_MSG_FILTER_KEY | ASYNC_MSG_FILTER_AT | ASYNC_MSG_FILTER_ANYWHERE)) &&
+           !(f->flags & ASYNC_MSG_FILTER_DROP);
+}
+
+/* whether msg of lane l gets past the file's ASYNC_MSG_SET_FILTER */
+static bool asyncmsg_filter_match(const struct asyncmsg_filter *f, struct async_msg *msg, int l)
+{
+    const char *data;
+
+    if (!f->flags && !f->prio_mask)
+        return true;
+    if (f->prio_mask && !(f->prio_mask & (1U << l)))
+        return false;
+    data = asyncmsg_data(msg);
+    if ((f->flags & ASYNC_MSG_FILTER_KEY) && (!msg->keyed || asyncmsg_key(data) != f->key))
+        return false;
+    if ((f->flags & ASYNC_MSG_FILTER_AT) &&
+        (msg->len < f->offset + f->len || memcmp(data + f->offset, f->pattern, f->len)))
+        return false;
+    if ((f->flags & ASYNC_MSG_FILTER_ANYWHERE) && !asyncmsg_contains(data, msg->len, f->pattern, f->len))
+        return false;
+    return true;
+}
+
+/*
+ * A filtered file is worth waking for a match in the first
+ * ASYNCMSG_FILTER_SCAN messages of a lane it reads, or for that many
+ * without one, which its read then skips in one go. Slots are only freed,
+ * swapped or overwritten under dev->lock, so the scan can do without sem.
+ * It runs with interrupts off from wakeups and eventfd notification, so
+ * verdicts are kept in the file and every message is looked at once: a
+ * compaction overwrite bumps dev->filter_gen, which throws them away.
+ * Once ASYNCMSG_FILTER_SCAN_BYTES of payload were searched the file counts
+ * as ready, the read sorts the rest out under sem.
+ */
+static bool asyncmsg_filter_ready(struct asyncmsg_file *ctx)
+{
+    struct asyncmsg_dev *dev = ctx->dev;
+    const struct asyncmsg_filter *f = &ctx->filter;
+    unsigned long flags;
+    unsigned int limit;
+    size_t spent = 0;
+    bool ready = false;
+
+    spin_lock_irqsave(&dev->lock, flags);
+    if (ctx->filter_gen != dev->filter_gen)
+    {
+        memset(ctx->filter_scan, 0, sizeof(ctx->filter_scan));
+        memset(ctx->filter_hit, 0, sizeof(ctx->filter_hit));
+        ctx->filter_gen = dev->filter_gen;
+    }
+    limit = min_t(unsigned int, ASYNCMSG_FILTER_SCAN, dev->max_queue_size);
+    for (int l = ASYNC_MSG_PRIO_LEVELS - 1; l >= 0 && !ready; l--)
+    {
+        struct asyncmsg_lane *lane = &dev->lanes[l];
+        u64 start = asyncmsg_read_pos(ctx, l);
+        u64 pos = max(start, ctx->filter_scan[l]);
+
+        if (!asyncmsg_lane_wanted(ctx, l))
+            continue;
+        if (ctx->filter_hit[l] > start)
+        {
+            ready = true;
+            break;
+        }
+        for (; pos < start + limit && asyncmsg_pos_ready(lane, pos); pos++)
+        {
+            struct async_msg *msg = asyncmsg_slot(lane, pos);
+
+            if (spent >= ASYNCMSG_FILTER_SCAN_BYTES)
+            {
+                ready = true;
+                break;
+            }
+            if (f->flags & ASYNC_MSG_FILTER_ANYWHERE)
+                spent += msg->len;
+            if (asyncmsg_filter_match(f, msg, l))
+            {
+                ctx->filter_hit[l] = pos + 1;
+                ready = true;
+                break;
+            }
+        }
+        ctx->filter_scan[l] = pos;
+        if (pos == start + limit)
+            ready = true;
+    }
+    spin_unlock_irqrestore(&dev->lock, flags);
+    return ready;
+}
+
+/* head message is published, it or a batch to drop is there for the filter, and the rx watermark is met */
+static bool asyncmsg_readable(struct asyncmsg_file *ctx)
+{
+    struct asyncmsg_dev *dev = ctx->dev;
+    u32 lowat = READ_ONCE(ctx->wm.rx_lowat);
+
+    if (!asyncmsg_ctx_ready(ctx))
+        return false;
+    if ((READ_ONCE(ctx->filter.flags) || READ_ONCE(ctx->filter.prio_mask)) &&
+        !asyncmsg_filter_ready(ctx))
+        return false;
+    if (lowat <= 1 || READ_ONCE(ctx->rx_expired))
+        return true;
+    return asyncmsg_ctx_count(ctx) >= min_t(u32, lowat, dev->max_queue_size);
+}
+
+/* writability is judged on the lane the file writes to by default */
+static bool asyncmsg_writable(struct asyncmsg_file *ctx)
+{
+    struct asyncmsg_lane *lane = &ctx->dev->lanes[READ_ONCE(ctx->prio.prio)];
+    u32 lowat = max_t(u32, READ_ONCE(ctx->wm.tx_lowat), 1);
+
+    return culc_free_space(ctx->dev, lane) >= min_t(u32, lowat, ctx->dev->max_queue_size);
+}
+
+/* signals the eventfds that asked for these events and whose watermark is met */
+static void asyncmsg_notify(struct asyncmsg_dev *dev, u32 events)
+{
+    struct asyncmsg_file *ctx;
+
+    if (list_empty(&dev->efd_list))
+        return;
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(ctx, &dev->efd_list, efd_node)
+    {
+        struct eventfd_ctx *efd = rcu_dereference(ctx->efd);
+        u32 want = events & ctx->efd_events;
+
+        if (efd && (((want & ASYNC_MSG_EV_IN) && asyncmsg_readable(ctx)) ||
+                    ((want & ASYNC_MSG_EV_OUT) && asyncmsg_writable(ctx))))
+            eventfd_signal(efd);
+    }
+    rcu_read_unlock();
+}
+
+/* under ring_lock or from release; notify and the rx timer only see efd under RCU */
+static void asyncmsg_efd_drop(struct asyncmsg_file *ctx)
+{
+    struct asyncmsg_dev *dev = ctx->dev;
+    struct eventfd_ctx *efd = rcu_dereference_protected(ctx->efd, 1);
+
+    if (!efd)
+        return;
+    spin_lock(&dev->efd_lock);
+    list_del_rcu(&ctx->efd_node);
+    spin_unlock(&dev->efd_lock);
+    rcu_assign_pointer(ctx->efd, NULL);
+    synchronize_rcu();
+    eventfd_ctx_put(efd);
+}
+
+static int asyncmsg_efd_set(struct asyncmsg_file *ctx, const struct asyncmsg_eventfd *arg)
+{
+    struct asyncmsg_dev *dev = ctx->dev;
+    struct eventfd_ctx *efd;
+
+    if (arg->events & ~(ASYNC_MSG_EV_IN | ASYNC_MSG_EV_OUT))
+        return -EINVAL;
+
+    if (mutex_lock_interruptible(&ctx->ring_lock))
+        return -ERESTARTSYS;
+    asyncmsg_efd_drop(ctx);
+    if (arg->fd >= 0)
+    {
+        efd = eventfd_ctx_fdget(arg->fd);
+        if (IS_ERR(efd))
+        {
+            mutex_unlock(&ctx->ring_lock);
+            return PTR_ERR(efd);
+        }
+        ctx->efd_events = arg->events;
+        rcu_assign_pointer(ctx->efd, efd);
+        spin_lock(&dev->efd_lock);
+        list_add_tail_rcu(&ctx->efd_node, &dev->efd_list);
+        spin_unlock(&dev->efd_lock);
+    }
+    mutex_unlock(&ctx->ring_lock);
+
+    /* стан міг бути готовий ще до реєстрації */
+    asyncmsg_notify(dev, arg->events);
+    return 0;
+}
+
+/* a blocking writer only needs one slot of its lane, it reserves what it can */
+static bool asyncmsg_has_room(struct asyncmsg_file *ctx, int prio)
+{
+    return culc_free_space(ctx->dev, &ctx->dev->lanes[prio]) > 0;
+}
+
+static bool asyncmsg_has_msgs(struct asyncmsg_file *ctx, int prio)
+{
+    return asyncmsg_readable(ctx);
+}
+
+/* starts the max-delay clock once messages sit below the watermark */
+static void asyncmsg_rx_arm(struct asyncmsg_file *ctx)
+{
+    u32 delay_us = READ_ONCE(ctx->wm.rx_max_delay_us);
+
+    if (delay_us && !READ_ONCE(ctx->rx_expired) && asyncmsg_ctx_ready(ctx) &&
+        !hrtimer_active(&ctx->rx_timer))
+        hrtimer_start(&ctx->rx_timer, us_to_ktime(delay_us), HRTIMER_MODE_REL);
+}
+
+static enum hrtimer_restart asyncmsg_rx_timer_fn(struct hrtimer *t)
+{
+    struct asyncmsg_file *ctx = container_of(t, struct asyncmsg_file, rx_timer);
+    struct eventfd_ctx *efd;
+
+    WRITE_ONCE(ctx->rx_expired, true);
+    wake_up(&ctx->dev->read_q);
+    rcu_read_lock();
+    efd = rcu_dereference(ctx->efd);
+    if (efd && (ctx->efd_events & ASYNC_MSG_EV_IN))
+        eventfd_signal(efd);
+    rcu_read_unlock();
+    return HRTIMER_NORESTART;
+}
+
+struct asyncmsg_waiter {
+    struct wait_queue_entry wq;
+    struct asyncmsg_file *ctx;
+    bool (*cond)(struct asyncmsg_file *ctx, int prio);
+    int prio;
+};
+
+/*
+ * Waiters are exclusive, so a wake_up() wakes one task. A waiter whose
+ * watermark is not met yet declines the wakeup, it goes on to the next one.
+ */
+static int asyncmsg_wake_fn(struct wait_queue_entry *wq, unsigned mode, int sync, void *key)
+{
+    struct asyncmsg_waiter *w = container_of(wq, struct asyncmsg_waiter, wq);
+
+    if (!w->cond(w->ctx, w->prio))
+    {
+        if (w->cond == asyncmsg_has_msgs)
+            asyncmsg_rx_arm(w->ctx);
+        return 0;
+    }
+    return autoremove_wake_function(wq, mode, sync, key);
+}
+
+/*
+ * wait_event_interruptible_timeout() with an exclusive, filtering waiter.
+ * Returns the jiffies left (at least 1) once cond holds, 0 on timeout and
+ * -ERESTARTSYS on a signal. prio is passed through to cond.
+ */
+static long asyncmsg_wait_exclusive(wait_queue_head_t *q, struct asyncmsg_file *ctx,
+                                    bool (*cond)(struct asyncmsg_file *ctx, int prio),
+                                    int prio, long timeout)
+{
+    struct asyncmsg_waiter w = { .ctx = ctx, .cond = cond, .prio = prio };
+
+    init_wait_entry(&w.wq, 0);
+    init_wait_func(&w.wq, asyncmsg_wake_fn);
+    for (;;)
+    {
+        prepare_to_wait_exclusive(q, &w.wq, TASK_INTERRUPTIBLE);
+        if (cond(ctx, prio))
+        {
+            timeout = max(timeout, 1L);
+            break;
+        }
+        if (signal_pending(current))
+        {
+            timeout = -ERESTARTSYS;
+            break;
+        }
+        if (!timeout)
+            break;
+        timeout = schedule_timeout(timeout);
+    }
+    finish_wait(q, &w.wq);
+
+    /* a wakeup we took but will not use goes to the next waiter */
+    if (timeout <= 0)
+        wake_up(q);
+    return timeout;
+}
+
+/*
+ * Called by a consumer after it handed freed slots back: wakes that many
+ * writers and passes the reader wakeup on if messages are left.
+ */
+static void asyncmsg_consumed(struct asyncmsg_file *ctx, unsigned int freed)
+{
+    struct asyncmsg_dev *dev = ctx->dev;
+
+    WRITE_ONCE(ctx->rx_expired, false);
+    /* a fan-out read frees nothing until the slowest cursor moves */
+    if (freed && wq_has_sleeper(&dev->write_q))
+    {
+        trace_asyncmsg_wakeup(dev->index, ASYNCMSG_WAKE_TX, freed);
+        wake_up_nr(&dev->write_q, freed);
+    }
+    /* in fan-out mode every reader was woken already */
+    if (!READ_ONCE(dev->fanout) && asyncmsg_head_ready(dev) && wq_has_sleeper(&dev->read_q))
+    {
+        trace_asyncmsg_wakeup(dev->index, ASYNCMSG_WAKE_RX, 1);
+        wake_up(&dev->read_q);
+    }
+    asyncmsg_notify(dev, ASYNC_MSG_EV_OUT);
+    asyncmsg_uring_kick_tx(dev);
+}
+
+static int asyncmsg_fasync(int fd, struct file *file, int on)
+{
+    struct asyncmsg_file *ctx = file->private_data;
+    struct asyncmsg_dev *dev = ctx->dev;
+    return fasync_helper(fd, file, on, &dev->fasync_queue);
+}
+
+static int asyncmsg_open(struct inode *inode, struct file *filp)
+{
+    struct asyncmsg_dev *dev = container_of(inode->i_cdev, struct asyncmsg_dev, cdev);
+    struct asyncmsg_file *ctx;
+    unsigned long flags;
+
+    ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+    if (!ctx)
+        return -ENOMEM;
+    ctx->dev = dev;
+    ctx->read_mode = ASYNC_MSG_READ_TEXT;
+    ctx->timeouts.read_ms = ASYNC_MSG_TIMEOUT_DEFAULT_MS;
+    ctx->timeouts.write_ms = ASYNC_MSG_TIMEOUT_DEFAULT_MS;
+    ctx->prio.policy = ASYNC_MSG_PRIO_STRICT;
+    for (int i = 0; i < ASYNC_MSG_PRIO_LEVELS; i++)
+        ctx->prio.weight[i] = 1;
+    hrtimer_setup(&ctx->rx_timer, asyncmsg_rx_timer_fn, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    mutex_init(&ctx->ring_lock);
+    filp->private_data = ctx;
+
+    spin_lock_irqsave(&dev->lock, flags);
+    dev->open_count++;
+    spin_unlock_irqrestore(&dev->lock, flags);
+    return 0;
+}
+
+static int asyncmsg_release(struct inode *inode, struct file *file)
+{
+    struct asyncmsg_file *ctx = file->private_data;
+    struct asyncmsg_dev *dev = ctx->dev;
+    unsigned long flags;
+
+    spin_lock_irqsave(&dev->lock, flags);
+    dev->open_count--;
+    spin_unlock_irqrestore(&dev->lock, flags);  
+
+    hrtimer_cancel(&ctx->rx_timer);
+    asyncmsg_efd_drop(ctx);
+    if (asyncmsg_filter_skips(&ctx->filter))
+    {
+        down(&dev->sem);
+        dev->skip_filters--;
+        up(&dev->sem);
+    }
+    asyncmsg_cursor_put(ctx);
+    asyncmsg_leases_release(ctx);
+    vfree(ctx->ring_mem);
+    kvfree(ctx->tx_frames);
+    kvfree(ctx->bounce);
+    kfree(ctx);
+    return 0;
+}
+
+/*
+ * Waits until the head message is published and the rx watermark is met.
+ * With busy_poll_us set the reader first spins for that long, which saves
+ * the wakeup when producers are fast. Then it sleeps for at most read_ms
+ * (0 waits forever).
+ */
+static int asyncmsg_wait_readable(struct asyncmsg_file *ctx, bool nonblock)
+{
+    struct asyncmsg_dev *dev = ctx->dev;
+    u32 busy_us = READ_ONCE(ctx->timeouts.busy_poll_us);
+    u32 tmo_ms = READ_ONCE(ctx->timeouts.read_ms);
+    long ret;
+
+    if (nonblock)
+        return asyncmsg_ctx_ready(ctx) ? 0 : -EAGAIN;
+    if (asyncmsg_readable(ctx))
+        return 0;
+
+    if (busy_us)
+    {
+        u64 end = local_clock() + busy_us * NSEC_PER_USEC;
+
+        while (!asyncmsg_readable(ctx))
+        {
+            if (signal_pending(current))
+                return -ERESTARTSYS;
+            if (need_resched() || local_clock() > end)
+                break;
+            cpu_relax();
+        }
+    }
+
+    asyncmsg_rx_arm(ctx);
+    ret = asyncmsg_wait_exclusive(&dev->read_q, ctx, asyncmsg_has_msgs, 0,
+                                  tmo_ms ? msecs_to_jiffies(tmo_ms) : MAX_SCHEDULE_TIMEOUT);
+    if (ret == 0)
+        return -EAGAIN;
+    return ret < 0 ? ret : 0;
+}
+
+static int asyncmsg_bounce_alloc(struct asyncmsg_file *ctx)
+{
+    struct asyncmsg_dev *dev = ctx->dev;
+    char *bounce;
+
+    if (READ_ONCE(ctx->bounce))
+        return 0;
+    bounce = kvmalloc(ASYNCMSG_BOUNCE_SIZE, GFP_KERNEL);
+    if(!bounce)
+    {
+        return -ENOMEM;
+    }
+    /* бінарне читання під dev->sem, тож під ним і встановлюємо буфер */
+    if(down_interruptible(&dev->sem))
+    {
+        kvfree(bounce);
+        return -ERESTARTSYS;
+    }
+    if(!ctx->bounce)
+        ctx->bounce = bounce;
+    else
+        kvfree(bounce);
+    up(&dev->sem);
+    return 0;
+}
+
+/*
+ * Picks the lane the next message comes from, next[] holds the position each
+ * lane has been read up to by the caller. Strict serves the highest lane that
+ * has a published message. Weighted goes round the lanes from the top and
+ * serves up to weight[lane] messages of each per turn. Returns -1 when no
+ * lane is ready. Called under dev->sem, which also guards the rr state.
+ */
+static int asyncmsg_pick_lane(struct asyncmsg_dev *dev, struct asyncmsg_file *ctx,
+                              const u64 *next)
+{
+    int l;
+
+    if (READ_ONCE(ctx->prio.policy) == ASYNC_MSG_PRIO_STRICT)
+    {
+        for (l = ASYNC_MSG_PRIO_LEVELS - 1; l >= 0; l--)
+            if (asyncmsg_lane_wanted(ctx, l) && asyncmsg_pos_ready(&dev->lanes[l], next[l]))
+                return l;
+        return -1;
+    }
+
+    /* the current lane with what is left of its credit, then a full round */
+    for (int i = 0; i <= ASYNC_MSG_PRIO_LEVELS; i++)
+    {
+        l = ctx->rr_lane;
+        if (ctx->rr_credit && asyncmsg_lane_wanted(ctx, l) &&
+            asyncmsg_pos_ready(&dev->lanes[l], next[l]))
+        {
+            ctx->rr_credit--;
+            return l;
+        }
+        ctx->rr_lane = l ? l - 1 : ASYNC_MSG_PRIO_LEVELS - 1;
+        ctx->rr_credit = max_t(u32, READ_ONCE(ctx->prio.weight[ctx->rr_lane]), 1);
+    }
+    return -1;
+}
+
+/* consumes every lane up to done[], returns how many slots were freed */
+static unsigned int asyncmsg_consume_lanes(struct asyncmsg_dev *dev, const u64 *done)
+{
+    unsigned int freed = 0;
+
+    for (int l = 0; l < ASYNC_MSG_PRIO_LEVELS; l++)
+    {
+        u64 head = atomic64_read(&dev->lanes[l].head);
+
+        if (done[l] == head)
+            continue;
+        freed += done[l] - head;
+        asyncmsg_consume(dev, l, done[l]);
+    }
+    return freed;
+}
+
+/*
+ * Fan-out: slots go back to the writers once the slowest cursor has passed
+ * them. With no cursor left nothing is reclaimed, the messages wait for the
+ * next reader like in a shared queue. Under sem.
+ */
+static unsigned int asyncmsg_reclaim(struct asyncmsg_dev *dev)
+{
+    struct asyncmsg_cursor *cur;
+    u64 done[ASYNC_MSG_PRIO_LEVELS];
+
+    if (list_empty(&dev->cursors))
+        return 0;
+    for (int l = 0; l < ASYNC_MSG_PRIO_LEVELS; l++)
+        done[l] = atomic64_read(&dev->lanes[l].tail);
+    list_for_each_entry(cur, &dev->cursors, node)
+        for (int l = 0; l < ASYNC_MSG_PRIO_LEVELS; l++)
+            done[l] = min(done[l], cur->pos[l]);
+    return asyncmsg_consume_lanes(dev, done);
+}
+
+static struct asyncmsg_cursor *asyncmsg_cursor_find(struct asyncmsg_dev *dev, const char *group)
+{
+    struct asyncmsg_cursor *cur;
+
+    list_for_each_entry(cur, &dev->cursors, node)
+        if (cur->group[0] && !strcmp(cur->group, group))
+            return cur;
+    return NULL;
+}
+
+/* attaches ctx to group, "" is a cursor of its own. Under sem. */
+static int asyncmsg_cursor_get(struct asyncmsg_file *ctx, const char *group, u32 flags)
+{
+    struct asyncmsg_dev *dev = ctx->dev;
+    struct asyncmsg_cursor *cur = group[0] ? asyncmsg_cursor_find(dev, group) : NULL;
+
+    if (ctx->cursor)
+        return -EBUSY;
+    if (!cur)
+    {
+        cur = kzalloc(sizeof(*cur), GFP_KERNEL);
+        if (!cur)
+            return -ENOMEM;
+        strscpy(cur->group, group, sizeof(cur->group));
+        for (int l = 0; l < ASYNC_MSG_PRIO_LEVELS; l++)
+            cur->pos[l] = atomic64_read(flags & ASYNC_MSG_SUB_LATEST ?
+                                        &dev->lanes[l].tail : &dev->lanes[l].head);
+        list_add_tail(&cur->node, &dev->cursors);
+    }
+    cur->users++;
+    WRITE_ONCE(ctx->cursor, cur);
+    return 0;
+}
+
+/* freed slots went back without a reader: wake that many writers */
+static void asyncmsg_freed(struct asyncmsg_dev *dev, unsigned int freed)
+{
+    if (!freed)
+        return;
+    wake_up_nr(&dev->write_q, freed);
+    asyncmsg_notify(dev, ASYNC_MSG_EV_OUT);
+    asyncmsg_uring_kick_tx(dev);
+}
+
+/* on release: the last user takes the cursor with it, which may free slots */
+static void asyncmsg_cursor_put(struct asyncmsg_file *ctx)
+{
+    struct asyncmsg_dev *dev = ctx->dev;
+    struct asyncmsg_cursor *cur = ctx->cursor;
+    unsigned int freed = 0;
+
+    if (!cur)
+        return;
+    down(&dev->sem);
+    if (!--cur->users)
+    {
+        list_del(&cur->node);
+        kfree(cur);
+        freed = asyncmsg_reclaim(dev);
+    }
+    ctx->cursor = NULL;
+    up(&dev->sem);
+
+    asyncmsg_freed(dev, freed);
+}
+
+static inline bool asyncmsg_ttl_over(const struct async_msg *msg, u64 now)
+{
+    return msg->ttl_ms && now > msg->timestamp_ns &&
+           now - msg->timestamp_ns >= (u64)msg->ttl_ms * NSEC_PER_MSEC;
+}
+
+/*
+ * Whether msg of lane prio is past its TTL. The first reader or sweep to
+ * get there counts it and, with ASYNC_MSG_TTL_DLQ, hands it to the DLQ;
+ * its slot is freed along with the ones read around it. Under sem.
+ */
+static bool asyncmsg_expire(struct asyncmsg_dev *dev, struct async_msg *msg,
+                            unsigned int prio, u64 now)
+{
+    if (msg->expired)
+        return true;
+    if (!asyncmsg_ttl_over(msg, now))
+        return false;
+    msg->expired = true;
+    this_cpu_inc(dev->stats->expired);
+    if (READ_ONCE(dev->ttl_flags) & ASYNC_MSG_TTL_DLQ)
+    {
+        struct asyncmsg_batch b = {
+            .buf = asyncmsg_data(msg),
+            .len = msg->len,
+            .n = 1,
+            .prio = prio,
+        };
+
+        save_to_dlq_db(dev, &b, 0, ASYNC_MSG_DLQ_EXPIRED);
+    }
+    return true;
+}
+
+/* a read passes msg by when it expired or the file's filter drops it. Under sem. */
+static bool asyncmsg_read_skip(struct asyncmsg_file *ctx, struct async_msg *msg, int l, u64 now)
+{
+    if (asyncmsg_expire(ctx->dev, msg, l, now))
+        return true;
+    if (asyncmsg_filter_match(&ctx->filter, msg, l))
+        return false;
+    this_cpu_inc(ctx->dev->stats->filtered);
+    return true;
+}
+
+/*
+ * Start positions of a read, under sem. A fan-out file gets its private
+ * cursor here if it did not subscribe.
+ */
+static int asyncmsg_read_start(struct asyncmsg_file *ctx, u64 *pos)
+{
+    if (READ_ONCE(ctx->dev->fanout) && !ctx->cursor)
+    {
+        int err = asyncmsg_cursor_get(ctx, "", 0);
+
+        if (err)
+            return err;
+    }
+    for (int l = 0; l < ASYNC_MSG_PRIO_LEVELS; l++)
+        pos[l] = asyncmsg_read_pos(ctx, l);
+    return 0;
+}
+
+/* file list in deadline order; new leases mostly go last, so it is searched from the tail */
+static void asyncmsg_lease_file_add(struct asyncmsg_leases *lt, struct asyncmsg_lease *ls)
+{
+    struct asyncmsg_lease *cur;
+
+    list_for_each_entry_reverse(cur, &lt->list, file_node)
+    {
+        if (cur->deadline_ns <= ls->deadline_ns)
+        {
+            list_add(&ls->file_node, &cur->file_node);
+            return;
+        }
+    }
+    list_add(&ls->file_node, &lt->list);
+}
+
+/*
+ * At-least-once: moves what ctx read, up to done[] in every lane, into
+ * leases before the slots are released. The payload goes with the lease.
+ * When a lease cannot be allocated its message and the ones after it stay
+ * queued and are read again, which at-least-once allows. Under sem.
+ */
+static void asyncmsg_lease_take(struct asyncmsg_file *ctx, u64 *done)
+{
+    struct asyncmsg_dev *dev = ctx->dev;
+    struct asyncmsg_leases *lt = ctx->leases;
+    u64 deadline = ktime_get_ns() + (u64)READ_ONCE(lt->timeout_ms) * NSEC_PER_MSEC;
+    struct asyncmsg_lease *first;
+    bool arm = false;
+    u64 next = 0;
+
+    for (int l = 0; l < ASYNC_MSG_PRIO_LEVELS; l++)
+    {
+        struct asyncmsg_lane *lane = &dev->lanes[l];
+
+        for (u64 pos = atomic64_read(&lane->head); pos < done[l]; pos++)
+        {
+            struct async_msg *msg = asyncmsg_slot(lane, pos);
+            struct asyncmsg_lease *ls;
+
+            /* skipped by the read, it goes with the consumed slots */
+            if (msg->expired || !asyncmsg_filter_match(&ctx->filter, msg, l))
+                continue;
+            ls = kmalloc(sizeof(*ls), GFP_KERNEL);
+            if (!ls)
+            {
+                done[l] = pos;
+                break;
+            }
+            /* the lease is not queued any more, a new value of its key is */
+            if (msg->keyed && dev->compact)
+                asyncmsg_key_unindex(dev, l, pos, msg);
+            ls->msg = *msg;
+            msg->ext = NULL;
+            msg->keyed = false;
+            ls->prio = l;
+            ls->deadline_ns = deadline;
+
+            spin_lock(&dev->lease_lock);
+            list_add_tail(&ls->lane_node, &dev->leases[l]);
+            asyncmsg_lease_file_add(lt, ls);
+            hash_add(lt->hash, &ls->hnode, ls->msg.seq);
+            spin_unlock(&dev->lease_lock);
+        }
+    }
+
+    /*
+     * A shorter SET_VISIBILITY puts new deadlines before older ones, the
+     * timer is moved up then. Pending work sets it when it is done.
+     */
+    spin_lock(&dev->lease_lock);
+    first = list_first_entry_or_null(&lt->list, struct asyncmsg_lease, file_node);
+    if (first && !work_pending(&lt->work))
+    {
+        next = first->deadline_ns;
+        arm = !hrtimer_active(&lt->timer) || ktime_to_ns(hrtimer_get_expires(&lt->timer)) > next;
+    }
+    spin_unlock(&dev->lease_lock);
+    if (arm)
+        hrtimer_start(&lt->timer, ns_to_ktime(next), HRTIMER_MODE_ABS);
+}
+
+/* ctx has read every lane up to done[], returns how many slots were freed */
+static unsigned int asyncmsg_read_done(struct asyncmsg_file *ctx, u64 *done)
+{
+    struct asyncmsg_cursor *cur = ctx->cursor;
+
+    if (!cur)
+    {
+        if (ctx->leases && READ_ONCE(ctx->leases->timeout_ms))
+            asyncmsg_lease_take(ctx, done);
+        return asyncmsg_consume_lanes(ctx->dev, done);
+    }
+    for (int l = 0; l < ASYNC_MSG_PRIO_LEVELS; l++)
+    {
+        cur->delivered += done[l] - cur->pos[l];
+        WRITE_ONCE(cur->pos[l], done[l]);
+    }
+    return asyncmsg_reclaim(ctx->dev);
+}
+
+/*
+ * Binary mode: drains as many whole records as fit into the user buffer,
+ * taking the lanes in the order the file's priority policy picks them.
+ * Messages are consumed only once their bytes have reached userspace, so a
+ * fault part way keeps the rest queued. Expired ones are skipped. With
+ * trylock a busy sem gives -EAGAIN instead of sleeping on it.
+ */
+static ssize_t asyncmsg_read_binary(struct asyncmsg_file *ctx, struct iov_iter *to, bool nonblock,
+                                    bool trylock)
+{
+    size_t count = iov_iter_count(to);
+    struct asyncmsg_dev *dev = ctx->dev;
+    size_t copied = 0, fill = 0;
+    u64 next[ASYNC_MSG_PRIO_LEVELS], done[ASYNC_MSG_PRIO_LEVELS];
+    bool classes = READ_ONCE(ctx->read_mode) == ASYNC_MSG_READ_BINARY_CLASSES;
+    size_t hdr = sizeof(struct asyncmsg_rec) + (classes ? sizeof(struct asyncmsg_classes) : 0);
+    unsigned int freed;
+    ssize_t err = 0;
+    int ret, l = -1;
+    bool skipped;
+    u64 now;
+
+retry:
+    ret = asyncmsg_wait_readable(ctx, nonblock);
+    if(ret)
+    {
+        return ret;
+    }
+
+    if (trylock)
+    {
+        if (down_trylock(&dev->sem))
+            return -EAGAIN;
+    }
+    else if(down_interruptible(&dev->sem))
+    {
+        return -ERESTARTSYS;
+    }
+
+    ret = asyncmsg_read_start(ctx, next);
+    if (ret)
+    {
+        up(&dev->sem);
+        return ret;
+    }
+    memcpy(done, next, sizeof(done));
+    skipped = false;
+    now = ktime_get_ns();
+    for (;;)
+    {
+        struct async_msg *msg;
+        struct asyncmsg_rec rec;
+        size_t size;
+
+        l = asyncmsg_pick_lane(dev, ctx, next);
+        if (l < 0)
+            break;
+        msg = asyncmsg_slot(&dev->lanes[l], next[l]);
+        if (asyncmsg_read_skip(ctx, msg, l, now))
+        {
+            next[l]++;
+            skipped = true;
+            continue;
+        }
+        size = ASYNC_MSG_REC_SIZE(hdr - sizeof(rec) + msg->len);
+        if (copied + fill + size > count)
+        {
+            if (!copied && !fill)
+                err = -EMSGSIZE;
+            break;
+        }
+        if (fill + size > ASYNCMSG_BOUNCE_SIZE)
+        {
+            if (copy_to_iter(ctx->bounce, fill, to) != fill)
+            {
+                err = -EFAULT;
+                fill = 0;
+                break;
+            }
+            copied += fill;
+            fill = 0;
+            memcpy(done, next, sizeof(done));
+        }
+
+        rec.len = msg->len;
+        rec.flags = (classes ? ASYNC_MSG_REC_CLASSES : 0) | (l << ASYNC_MSG_REC_PRIO_SHIFT) |
+                    (msg->redelivered ? ASYNC_MSG_REC_REDELIVERED : 0) |
+                    (msg->keyed ? ASYNC_MSG_REC_KEY : 0);
+        rec.seq = msg->seq;
+        rec.timestamp_ns = msg->timestamp_ns;
+        memcpy(ctx->bounce + fill, &rec, sizeof(rec));
+        if (classes)
+        {
+            if (!msg->classified)
+                asyncmsg_classify(msg);
+            memcpy(ctx->bounce + fill + sizeof(rec), &msg->cls, sizeof(msg->cls));
+        }
+        memcpy(ctx->bounce + fill + hdr, asyncmsg_data(msg), msg->len);
+        memset(ctx->bounce + fill + hdr + msg->len, 0, size - hdr - msg->len);
+        fill += size;
+        msg->processed = true;
+        next[l]++;
+    }
+
+    if (fill)
+    {
+        if (copy_to_iter(ctx->bounce, fill, to) != fill)
+        {
+            err = -EFAULT;
+        }
+        else
+        {
+            copied += fill;
+            memcpy(done, next, sizeof(done));
+        }
+    }
+
+    if (!copied)
+    {
+        /* були тільки прострочені або відфільтровані - прибираємо їх і чекаємо далі */
+        if (skipped && !err)
+        {
+            freed = asyncmsg_read_done(ctx, next);
+            up(&dev->sem);
+            asyncmsg_consumed(ctx, freed);
+            goto retry;
+        }
+        up(&dev->sem);
+        /* інший читач встиг забрати повідомлення раніше */
+        if (!err && l < 0)
+            goto retry;
+        return err;
+    }
+
+    freed = asyncmsg_read_done(ctx, done);
+    up(&dev->sem);
+    asyncmsg_consumed(ctx, freed);
+
+    return copied;
+}
+
+/*
+ * read(), readv() and, through copy_splice_read(), splice() from the device
+ * into a pipe.
+ */
+static ssize_t asyncmsg_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    char tmp[RETURN_MESSAGE];
+    char *out = tmp;
+    struct asyncmsg_file *ctx = iocb->ki_filp->private_data;
+    struct asyncmsg_dev *dev = ctx->dev;
+    bool nonblock = (iocb->ki_flags & IOCB_NOWAIT) || (iocb->ki_filp->f_flags & O_NONBLOCK);
+    size_t count = iov_iter_count(to);
+    size_t size;
+    int len, ret;
+
+    if (ctx->read_mode != ASYNC_MSG_READ_TEXT)
+    {
+        return asyncmsg_read_binary(ctx, to, nonblock, iocb->ki_flags & IOCB_NOWAIT);
+    }
+
+    if (iocb->ki_pos > 0)
+    {
+        return 0;
+    }
+
+retry:
+    ret = asyncmsg_wait_readable(ctx, nonblock);
+    if(ret)
+    {
+        return ret;
+    }
+
+    if(down_interruptible(&dev->sem))
+    {
+        return -ERESTARTSYS;
+    }
+
+    u64 head[ASYNC_MSG_PRIO_LEVELS];
+    unsigned int freed;
+    int l;
+
+    ret = asyncmsg_read_start(ctx, head);
+    if (ret)
+    {
+        up(&dev->sem);
+        return ret;
+    }
+    struct async_msg *curr_msg = NULL;
+    bool skipped = false;
+    u64 now = ktime_get_ns();
+
+    while ((l = asyncmsg_pick_lane(dev, ctx, head)) >= 0)
+    {
+        curr_msg = asyncmsg_slot(&dev->lanes[l], head[l]);
+        if (!asyncmsg_read_skip(ctx, curr_msg, l, now))
+            break;
+        head[l]++;
+        skipped = true;
+    }
+    if (l < 0)
+    {
+        /* були тільки прострочені або відфільтровані - прибираємо їх і чекаємо далі */
+        freed = skipped ? asyncmsg_read_done(ctx, head) : 0;
+        up(&dev->sem);
+        if (skipped)
+            asyncmsg_consumed(ctx, freed);
+        goto retry;
+    }
+    curr_msg->processed = true;
+
+    /* довгим повідомленням стека не вистачить */
+    size = RETURN_MESSAGE + curr_msg->len;
+    if (curr_msg->len > MSG_INLINE_LEN)
+    {
+        out = kvmalloc(size, GFP_KERNEL);
+        if (!out)
+        {
+            up(&dev->sem);
+            return -ENOMEM;
+        }
+    }
+    else
+    {
+        size = sizeof(tmp);
+    }
+
+    if (!curr_msg->classified)
+        asyncmsg_classify(curr_msg);
+    len = snprintf(out, size,
+        "message: %.*s\nlen: %u\ntimestamp_ns: %lld\nprocessed: %d\nprio: %d\n"
+        "seq: %llu\nredelivered: %d\n"
+        "alpha: %u\ndigit: %u\nspace: %u\nother: %u\n",
+        (int)curr_msg->len, asyncmsg_data(curr_msg),
+        curr_msg->len,
+        curr_msg->timestamp_ns,
+        curr_msg->processed,
+        l,
+        curr_msg->seq,
+        curr_msg->redelivered,
+        curr_msg->cls.alpha, curr_msg->cls.digit,
+        curr_msg->cls.space, curr_msg->cls.other);
+    len = min_t(size_t, len, count);
+
+    if (copy_to_iter(out, len, to) != len)
+    {
+        if (out != tmp)
+            kvfree(out);
+        up(&dev->sem);
+        return -EFAULT;
+    }
+    if (out != tmp)
+        kvfree(out);
+
+    /* слот повертається писачам тільки після того, як ми з ним закінчили */
+    head[l]++;
+    freed = asyncmsg_read_done(ctx, head);
+    iocb->ki_pos += len;
+    up(&dev->sem);
+    asyncmsg_consumed(ctx, freed);
+
+    return len;
+}
+
+/* rate is only kept for stats, interval_ns is what the bucket enforces */
+static void asyncmsg_bucket_set(struct asyncmsg_bucket *b, u64 interval_ns, u32 rate, u32 burst)
+{
+    WRITE_ONCE(b->interval_ns, interval_ns);
+    WRITE_ONCE(b->burst, max_t(u32, burst, 1));
+    WRITE_ONCE(b->rate, rate);
+    atomic64_set(&b->tat, 0);
+}
+
+static void asyncmsg_rate_set(struct asyncmsg_bucket *b, u32 rate, u32 burst)
+{
+    asyncmsg_bucket_set(b, rate ? div64_u64(NSEC_PER_SEC, rate) : 0, rate, burst);
+}
+
+/* takes up to n tokens and returns how many it got */
+static unsigned int asyncmsg_rate_take(struct asyncmsg_bucket *b, unsigned int n, u64 now)
+{
+    u64 t = READ_ONCE(b->interval_ns);
+    u64 limit = now + READ_ONCE(b->burst) * t;
+    s64 tat;
+    u64 base;
+    unsigned int k;
+
+    if (!t || !n)
+        return n;
+    tat = atomic64_read(&b->tat);
+    do {
+        base = max_t(u64, tat, now);
+        if (base + t > limit)
+            return 0;
+        k = min_t(u64, n, div64_u64(limit - base, t));
+    } while (!atomic64_try_cmpxchg(&b->tat, &tat, base + k * t));
+    return k;
+}
+
+/* gives back tokens that were taken but not used */
+static void asyncmsg_rate_put(struct asyncmsg_bucket *b, unsigned int n)
+{
+    u64 t = READ_ONCE(b->interval_ns);
+
+    if (t && n)
+        atomic64_sub(n * t, &b->tat);
+}
+
+/* cheap peek before anything is copied: is there at least one token? */
+static bool asyncmsg_rate_ready(struct asyncmsg_file *ctx)
+{
+    u64 now = ktime_get_ns();
+    struct asyncmsg_bucket *b[] = { &ctx->rate, &ctx->dev->rate };
+
+    for (int i = 0; i < ARRAY_SIZE(b); i++)
+    {
+        u64 t = READ_ONCE(b[i]->interval_ns);
+
+        if (t && max_t(u64, atomic64_read(&b[i]->tat), now) + t > now + READ_ONCE(b[i]->burst) * t)
+            return false;
+    }
+    return true;
+}
+
+/* the first message with a TTL brings the sweep forward from the stats interval */
+static void asyncmsg_ttl_start(struct asyncmsg_dev *dev)
+{
+    WRITE_ONCE(dev->ttl_used, true);
+    mod_timer(&dev->stat_timer, jiffies + msecs_to_jiffies(READ_ONCE(dev->sweep_ms)));
+}
+
+/* k messages from pos are visible: accounting and wakeups */
+static void asyncmsg_published(struct asyncmsg_dev *dev, struct asyncmsg_lane *lane,
+                               u64 pos, unsigned int k, u64 bytes)
+{
+    u64 depth;
+
+    depth = asyncmsg_count(dev);
+    this_cpu_add(dev->stats->enqueued, k);
+    this_cpu_add(dev->stats->enqueued_bytes, bytes);
+    asyncmsg_stat_depth(dev, depth);
+    trace_asyncmsg_enqueue(dev->index, pos + lane->seq_base, k, bytes, depth);
+
+    /* SIGIO тільки коли смуга була порожня: одна пачка - щонайбільше один сигнал */
+    if(dev->fasync_queue && pos == atomic64_read(&lane->head))
+    {
+        kill_fasync(&dev->fasync_queue, SIGIO, POLL_IN);
+    }
+
+    /*
+     * будимо одного читача, він передасть далі, якщо щось залишиться.
+     * У fan-out режимі повідомлення потрібне кожному курсору - будимо всіх
+     */
+    if(wq_has_sleeper(&dev->read_q))
+    {
+        if(READ_ONCE(dev->fanout))
+        {
+            trace_asyncmsg_wakeup(dev->index, ASYNCMSG_WAKE_RX, 0);
+            wake_up_all(&dev->read_q);
+        }
+        else
+        {
+            trace_asyncmsg_wakeup(dev->index, ASYNCMSG_WAKE_RX, 1);
+            wake_up(&dev->read_q);
+        }
+    }
+    asyncmsg_notify(dev, ASYNC_MSG_EV_IN);
+    asyncmsg_uring_kick_rx(dev);
+    queue_work(dev->wq, &dev->cls_work);
+}
+
+/*
+ * Takes tokens for up to n messages from the file's and the queue's bucket
+ * and returns how many may go, what is refused is counted here.
+ */
+static unsigned int asyncmsg_rate_admit(struct asyncmsg_file *ctx, unsigned int n)
+{
+    struct asyncmsg_dev *dev = ctx->dev;
+    u64 now = ktime_get_ns();
+    unsigned int file_ok, allowed;
+
+    file_ok = asyncmsg_rate_take(&ctx->rate, n, now);
+    allowed = asyncmsg_rate_take(&dev->rate, file_ok, now);
+    asyncmsg_rate_put(&ctx->rate, file_ok - allowed);
+    if (allowed < n)
+    {
+        this_cpu_add(dev->stats->rate_limited, n - allowed);
+        trace_asyncmsg_rate_limit(dev->index, n, file_ok, allowed);
+    }
+    return allowed;
+}
+
+static int asyncmsg_enqueue_keyed(struct asyncmsg_file *ctx, struct asyncmsg_batch *b, bool nonblock);
+
+/*
+ * Admission, rate limit, reservation and DLQ are decided once per batch.
+ * Returns how many messages from the front of the batch were queued.
+ */
+static int asyncmsg_enqueue(struct asyncmsg_file *ctx, struct asyncmsg_batch *b, bool nonblock)
+{
+    struct asyncmsg_dev *dev = ctx->dev;
+    struct asyncmsg_lane *lane = &dev->lanes[b->prio];
+    u32 tmo_ms = READ_ONCE(ctx->timeouts.write_ms);
+    u32 ttl_ms = READ_ONCE(dev->ttl_ms);
+    unsigned int allowed;
+    size_t off = 0;
+    u64 bytes = 0;
+    long ret;
+    int k;
+    u64 pos, now;
+
+    if (b->keys && READ_ONCE(dev->compact))
+        return asyncmsg_enqueue_keyed(ctx, b, nonblock);
+
+    /* 1. Смуга переповнена, а чекати не можна - пишемо в DLQ і виходимо */
+    if (nonblock && !b->will_wait && culc_free_space(dev, lane) == 0)
+    {
+        save_to_dlq_db(dev, b, 0, ASYNC_MSG_DLQ_QUEUE_FULL);
+        return -EAGAIN;
+    }
+
+    /*
+     * 2. Rate limit без блокування: беремо токени з bucket файлу і черги.
+     *    Пачка може пройти частково, решта лишається у писача (EAGAIN, без DLQ).
+     */
+    allowed = asyncmsg_rate_admit(ctx, b->n);
+    if (!allowed)
+        return -EAGAIN;
+
+    /*
+     * 3. Резервуємо слоти одним cmpxchg. Якщо місця нема - чекаємо (O_NONBLOCK
+     *    не чекає), таймаут пишемо в DLQ
+     */
+    percpu_down_read(&dev->resize_sem);
+    while ((k = asyncmsg_reserve(dev, lane, allowed, &pos)) < 0)
+    {
+        percpu_up_read(&dev->resize_sem);
+        if (nonblock)
+        {
+            asyncmsg_rate_put(&ctx->rate, allowed);
+            asyncmsg_rate_put(&dev->rate, allowed);
+            return -EAGAIN;
+        }
+        ret = asyncmsg_wait_exclusive(&dev->write_q, ctx, asyncmsg_has_room, b->prio,
+                                      tmo_ms ? msecs_to_jiffies(tmo_ms) : MAX_SCHEDULE_TIMEOUT);
+        if(ret == 0)
+        {
+            asyncmsg_rate_put(&ctx->rate, allowed);
+            asyncmsg_rate_put(&dev->rate, allowed);
+            this_cpu_inc(dev->stats->wait_timeouts);
+            save_to_dlq_db(dev, b, 0, ASYNC_MSG_DLQ_WAIT_TIMEOUT);
+            return -ETIMEDOUT;
+        }
+        if(ret < 0)
+        {
+            asyncmsg_rate_put(&ctx->rate, allowed);
+            asyncmsg_rate_put(&dev->rate, allowed);
+            return ret;
+        }
+        percpu_down_read(&dev->resize_sem);
+    }
+    asyncmsg_rate_put(&ctx->rate, allowed - k);
+    asyncmsg_rate_put(&dev->rate, allowed - k);
+    b->pos = pos;
+
+    /* ТУТ ВЖЕ ВСЕ ДОБРЕ. Пишемо повідомлення прямо в зарезервовані слоти */
+    now = ktime_get_ns();
+    for (int i = 0; i < k; i++)
+    {
+        struct async_msg *new_mess = asyncmsg_slot(lane, pos + i);
+        u32 len;
+        u32 ttl = asyncmsg_batch_ttl(b, off, ttl_ms);
+        bool keyed = asyncmsg_batch_keyed(b, off);
+        const char *data = asyncmsg_batch_next(b, &off, &len);
+
+        if (b->ext && b->ext[i])
+        {
+            new_mess->ext = b->ext[i];
+            b->ext[i] = NULL;
+        }
+        else
+        {
+            new_mess->ext = NULL;
+            asyncmsg_batch_copy(b, i, new_mess->inline_msg, data, len);
+        }
+        new_mess->timestamp_ns = now;
+        new_mess->ttl_ms = ttl;
+        new_mess->len = len;
+        new_mess->seq = pos + i + lane->seq_base;
+        new_mess->processed = false;
+        new_mess->classified = false;
+        new_mess->redelivered = false;
+        new_mess->expired = false;
+        new_mess->keyed = keyed;
+        if (ttl && !READ_ONCE(dev->ttl_used))
+            asyncmsg_ttl_start(dev);
+
+        /* Ставимо запис у чергу на збереження до того, як читач його побачить */
+        save_to_log(dev, new_mess);
+        asyncmsg_publish(new_mess, pos + i);
+        bytes += len;
+    }
+    percpu_up_read(&dev->resize_sem);
+
+    asyncmsg_published(dev, lane, pos, k, bytes);
+
+    return k;
+}
+
+/*
+ * Compaction: overwrites the queued message of key in the lane of b, which
+ * holds one keyed message, unless no reader may still see it there.
+ * Returns 1 when it did, 0 when b has to be queued. Under sem.
+ */
+static int asyncmsg_key_replace(struct asyncmsg_file *ctx, struct asyncmsg_batch *b, u64 key)
+{
+    struct asyncmsg_dev *dev = ctx->dev;
+    struct asyncmsg_lane *lane = &dev->lanes[b->prio];
+    struct asyncmsg_key_ent *ent = asyncmsg_key_find(dev, b->prio, key);
+    struct asyncmsg_cursor *cur;
+    struct async_msg *msg;
+    unsigned long flags;
+    const char *data;
+    size_t off = 0;
+    u32 len, ttl;
+
+    if (!ent)
+        return 0;
+    /* a cursor that read the old value has to get the new one too */
+    list_for_each_entry(cur, &dev->cursors, node)
+        if (cur->pos[b->prio] > ent->pos)
+            return 0;
+    if (!asyncmsg_rate_admit(ctx, 1))
+        return -EAGAIN;
+
+    msg = asyncmsg_slot(lane, ent->pos);
+    ttl = asyncmsg_batch_ttl(b, off, READ_ONCE(dev->ttl_ms));
+    data = asyncmsg_batch_next(b, &off, &len);
+    /* filtered wakeups look at queued payloads under dev->lock only */
+    spin_lock_irqsave(&dev->lock, flags);
+    asyncmsg_msg_free(msg);
+    if (b->ext && b->ext[0])
+    {
+        msg->ext = b->ext[0];
+        b->ext[0] = NULL;
+    }
+    else
+    {
+        asyncmsg_batch_copy(b, 0, msg->inline_msg, data, len);
+    }
+    msg->len = len;
+    dev->filter_gen++;
+    spin_unlock_irqrestore(&dev->lock, flags);
+    msg->timestamp_ns = ktime_get_ns();
+    msg->ttl_ms = ttl;
+    msg->processed = false;
+    msg->classified = false;
+    msg->redelivered = false;
+    msg->expired = false;
+    if (ttl && !READ_ONCE(dev->ttl_used))
+        asyncmsg_ttl_start(dev);
+    /* same seq and a higher gen, replay keeps this record */
+    save_to_log(dev, msg);
+    this_cpu_inc(dev->stats->compacted);
+    return 1;
+}
+
+/* points key at the message just queued at pos, unless a reader took it already */
+static void asyncmsg_key_index(struct asyncmsg_dev *dev, unsigned int prio, u64 key, u64 pos)
+{
+    struct asyncmsg_key_ent *ent, *old;
+
+    /* without an entry the message is queued all the same, only not merged into */
+    ent = kzalloc(sizeof(*ent), GFP_KERNEL);
+    if (!ent)
+        return;
+    ent->id.key = key;
+    ent->id.prio = prio;
+    ent->pos = pos;
+
+    down(&dev->sem);
+    if (!dev->compact || pos < atomic64_read(&dev->lanes[prio].head))
+        old = ERR_PTR(-ENOENT);
+    else
+        old = rhashtable_lookup_get_insert_fast(&dev->keys, &ent->node, asyncmsg_key_params);
+    if (!IS_ERR_OR_NULL(old))
+        old->pos = pos;
+    up(&dev->sem);
+    if (old)
+        kfree(ent);
+}
+
+/*
+ * Waits for room in lane prio with key_lock dropped, so a full lane does not
+ * hold up other keyed writers. Returns 0 with key_lock taken again, anything
+ * else without it; a timeout sends one to the DLQ like any write.
+ */
+static int asyncmsg_key_wait_room(struct asyncmsg_file *ctx, struct asyncmsg_batch *one)
+{
+    struct asyncmsg_dev *dev = ctx->dev;
+    u32 tmo_ms = READ_ONCE(ctx->timeouts.write_ms);
+    long ret;
+
+    mutex_unlock(&dev->key_lock);
+    ret = asyncmsg_wait_exclusive(&dev->write_q, ctx, asyncmsg_has_room, one->prio,
+                                  tmo_ms ? msecs_to_jiffies(tmo_ms) : MAX_SCHEDULE_TIMEOUT);
+    if (ret == 0)
+    {
+        this_cpu_inc(dev->stats->wait_timeouts);
+        save_to_dlq_db(dev, one, 0, ASYNC_MSG_DLQ_WAIT_TIMEOUT);
+        return -ETIMEDOUT;
+    }
+    if (ret < 0)
+        return ret;
+    if (mutex_lock_interruptible(&dev->key_lock))
+        return -ERESTARTSYS;
+    return 0;
+}
+
+/*
+ * Compaction: keyed messages go one at a time under key_lock, so two
+ * writers of a new key cannot both queue it. The first message may wait
+ * for room or go to the DLQ like any write, later ones stop at a full
+ * lane and leave a short write. Nothing sleeps for room under key_lock, a
+ * message that had to wait looks its key up again.
+ */
+static int asyncmsg_enqueue_keyed(struct asyncmsg_file *ctx, struct asyncmsg_batch *b, bool nonblock)
+{
+    struct asyncmsg_dev *dev = ctx->dev;
+    size_t off = 0;
+    int done = 0, ret = 0;
+
+    if (mutex_lock_interruptible(&dev->key_lock))
+        return -ERESTARTSYS;
+    /* turned off meanwhile */
+    if (!dev->compact)
+    {
+        mutex_unlock(&dev->key_lock);
+        b->keys = false;
+        return asyncmsg_enqueue(ctx, b, nonblock);
+    }
+
+    for (unsigned int i = 0; i < b->n; i++)
+    {
+        const struct asyncmsg_rec *rec = asyncmsg_batch_rec(b, off);
+        struct asyncmsg_batch one = {
+            .n = 1,
+            .framed = true,
+            .ext = b->ext ? &b->ext[i] : NULL,
+            .prio = b->prio,
+            .will_wait = !nonblock,
+        };
+        bool keyed = rec->flags & ASYNC_MSG_REC_KEY;
+        u64 key = 0;
+
+        if (b->frames)
+        {
+            one.frames = &b->frames[i];
+            key = one.frames->key;
+            off++;
+        }
+        else
+        {
+            one.buf = b->buf + off;
+            one.len = min(ASYNC_MSG_REC_SIZE(rec->len), b->len - off);
+            if (keyed)
+                key = asyncmsg_key((const char *)(rec + 1));
+            off += one.len;
+        }
+retry:
+        /* turned off while the lock was dropped */
+        if (!dev->compact)
+            keyed = false;
+        if (keyed)
+        {
+            if (down_interruptible(&dev->sem))
+            {
+                ret = -ERESTARTSYS;
+                break;
+            }
+            ret = asyncmsg_key_replace(ctx, &one, key);
+            up(&dev->sem);
+            if (ret < 0)
+                break;
+            if (ret)
+            {
+                done++;
+                continue;
+            }
+        }
+        if (done && culc_free_space(dev, &dev->lanes[b->prio]) == 0)
+            break;
+        ret = asyncmsg_enqueue(ctx, &one, true);
+        if (ret == -EAGAIN && one.will_wait && !done && culc_free_space(dev, &dev->lanes[b->prio]) == 0)
+        {
+            ret = asyncmsg_key_wait_room(ctx, &one);
+            if (ret)
+                return ret;
+            goto retry;
+        }
+        if (ret <= 0)
+            break;
+        if (keyed)
+            asyncmsg_key_index(dev, b->prio, key, one.pos);
+        done++;
+    }
+    mutex_unlock(&dev->key_lock);
+    return done ? done : ret;
+}
+
+/*
+ * Puts a leased message back at the tail of its lane with a new seq. It is
+ * logged again, the old record stops counting once the lease is gone.
+ * Returns -ENOSPC and keeps nothing when the lane is full.
+ */
+static int asyncmsg_redeliver(struct asyncmsg_dev *dev, struct asyncmsg_lease *ls)
+{
+    struct asyncmsg_lane *lane = &dev->lanes[ls->prio];
+    struct async_msg *slot;
+    u32 len = ls->msg.len;
+    u64 pos;
+
+    percpu_down_read(&dev->resize_sem);
+    if (asyncmsg_reserve(dev, lane, 1, &pos) < 0)
+    {
+        percpu_up_read(&dev->resize_sem);
+        return -ENOSPC;
+    }
+    slot = asyncmsg_slot(lane, pos);
+    slot->ext = ls->msg.ext;
+    if (!slot->ext)
+        memcpy(slot->inline_msg, ls->msg.inline_msg, len);
+    slot->len = len;
+    slot->timestamp_ns = ls->msg.timestamp_ns;
+    slot->ttl_ms = ls->msg.ttl_ms;
+    slot->expired = false;
+    slot->keyed = ls->msg.keyed;
+    slot->seq = pos + lane->seq_base;
+    slot->processed = false;
+    slot->classified = ls->msg.classified;
+    slot->cls = ls->msg.cls;
+    slot->redelivered = true;
+    save_to_log(dev, slot);
+    asyncmsg_publish(slot, pos);
+    percpu_up_read(&dev->resize_sem);
+
+    asyncmsg_published(dev, lane, pos, 1, len);
+    return 0;
+}
+
+static void asyncmsg_lease_unlink(struct asyncmsg_lease *ls)
+{
+    list_del(&ls->lane_node);
+    list_del(&ls->file_node);
+    hash_del(&ls->hnode);
+}
+
+/* back into the owner's tables after a failed redelivery, lane list in seq order */
+static void asyncmsg_lease_relink(struct asyncmsg_dev *dev, struct asyncmsg_leases *lt,
+                                  struct asyncmsg_lease *ls)
+{
+    struct list_head *at = &dev->leases[ls->prio];
+    struct asyncmsg_lease *cur;
+
+    list_for_each_entry(cur, &dev->leases[ls->prio], lane_node)
+    {
+        if (cur->msg.seq > ls->msg.seq)
+        {
+            at = &cur->lane_node;
+            break;
+        }
+    }
+    list_add_tail(&ls->lane_node, at);
+    list_add(&ls->file_node, &lt->list);
+    hash_add(lt->hash, &ls->hnode, ls->msg.seq);
+}
+
+static enum hrtimer_restart asyncmsg_lease_timer_fn(struct hrtimer *t)
+{
+    struct asyncmsg_leases *lt = container_of(t, struct asyncmsg_leases, timer);
+
+    queue_work(lt->ctx->dev->wq, &lt->work);
+    return HRTIMER_NORESTART;
+}
+
+/*
+ * Redelivers the expired leases of one file. Only the front of the list is
+ * looked at, asyncmsg_lease_file_add() keeps it in deadline order. Sets the timer for the next deadline,
+ * or for a retry when a lane had no room.
+ */
+static void asyncmsg_lease_work_fn(struct work_struct *work)
+{
+    struct asyncmsg_leases *lt = container_of(work, struct asyncmsg_leases, work);
+    struct asyncmsg_dev *dev = lt->ctx->dev;
+    u64 now = ktime_get_ns();
+    u64 next = 0;
+
+    for (;;)
+    {
+        struct asyncmsg_lease *ls;
+
+        spin_lock(&dev->lease_lock);
+        ls = list_first_entry_or_null(&lt->list, struct asyncmsg_lease, file_node);
+        if (ls && ls->deadline_ns > now)
+        {
+            next = ls->deadline_ns;
+            ls = NULL;
+        }
+        else if (ls)
+        {
+            asyncmsg_lease_unlink(ls);
+        }
+        spin_unlock(&dev->lease_lock);
+        if (!ls)
+            break;
+
+        if (asyncmsg_redeliver(dev, ls))
+        {
+            spin_lock(&dev->lease_lock);
+            asyncmsg_lease_relink(dev, lt, ls);
+            spin_unlock(&dev->lease_lock);
+            next = now + ASYNCMSG_LEASE_RETRY_MS * NSEC_PER_MSEC;
+            break;
+        }
+        asyncmsg_checkpoint_lane(dev, ls->prio, atomic64_read(&dev->lanes[ls->prio].head));
+        kfree(ls);
+    }
+
+    if (next && !READ_ONCE(lt->dying))
+        hrtimer_start(&lt->timer, ns_to_ktime(next), HRTIMER_MODE_ABS);
+}
+
+static struct asyncmsg_lease *asyncmsg_lease_find(struct asyncmsg_leases *lt, u64 seq)
+{
+    struct asyncmsg_lease *ls;
+
+    hash_for_each_possible(lt->hash, ls, hnode, seq)
+        if (ls->msg.seq == seq)
+            return ls;
+    return NULL;
+}
+
+#define ASYNCMSG_ACK_CHUNK 64
+
+/* ASYNC_MSG_ACK: frees the leases it finds, the rest are not ours or expired */
+static long asyncmsg_ack(struct asyncmsg_file *ctx, const struct asyncmsg_ack __user *uarg)
+{
+    struct asyncmsg_dev *dev = ctx->dev;
+    struct asyncmsg_leases *lt = ctx->leases;
+    bool moved[ASYNC_MSG_PRIO_LEVELS] = { };
+    u64 ids[ASYNCMSG_ACK_CHUNK];
+    struct asyncmsg_ack req;
+    const u64 __user *src;
+    long acked = 0;
+
+    if (copy_from_user(&req, uarg, sizeof(req)))
+        return -EFAULT;
+    if (req.reserved)
+        return -EINVAL;
+    if (!lt)
+        return 0;
+    src = u64_to_user_ptr(req.addr);
+
+    for (u32 i = 0; i < req.count; i += ASYNCMSG_ACK_CHUNK)
+    {
+        u32 n = min_t(u32, req.count - i, ASYNCMSG_ACK_CHUNK);
+
+        if (copy_from_user(ids, src + i, n * sizeof(u64)))
+        {
+            if (!acked)
+                acked = -EFAULT;
+            break;
+        }
+        for (u32 j = 0; j < n; j++)
+        {
+            struct asyncmsg_lease *ls;
+
+            spin_lock(&dev->lease_lock);
+            ls = asyncmsg_lease_find(lt, ids[j]);
+            if (ls)
+            {
+                /* only the oldest lease of a lane holds the checkpoint */
+                if (dev->leases[ls->prio].next == &ls->lane_node)
+                    moved[ls->prio] = true;
+                asyncmsg_lease_unlink(ls);
+            }
+            spin_unlock(&dev->lease_lock);
+            if (!ls)
+                continue;
+            asyncmsg_msg_free(&ls->msg);
+            kfree(ls);
+            acked++;
+        }
+    }
+
+    for (int l = 0; l < ASYNC_MSG_PRIO_LEVELS; l++)
+        if (moved[l])
+            asyncmsg_checkpoint_lane(dev, l, atomic64_read(&dev->lanes[l].head));
+    return acked;
+}
+
+/*
+ * On release: the unacked leases go back to their lanes at once, to the DLQ
+ * when a lane is full, so closing never loses a message.
+ */
+static void asyncmsg_leases_release(struct asyncmsg_file *ctx)
+{
+    struct asyncmsg_dev *dev = ctx->dev;
+    struct asyncmsg_leases *lt = ctx->leases;
+
+    if (!lt)
+        return;
+    /* dying stops work from setting the timer again */
+    WRITE_ONCE(lt->dying, true);
+    cancel_work_sync(&lt->work);
+    hrtimer_cancel(&lt->timer);
+    cancel_work_sync(&lt->work);
+
+    for (;;)
+    {
+        struct asyncmsg_lease *ls;
+
+        spin_lock(&dev->lease_lock);
+        ls = list_first_entry_or_null(&lt->list, struct asyncmsg_lease, file_node);
+        if (ls)
+            asyncmsg_lease_unlink(ls);
+        spin_unlock(&dev->lease_lock);
+        if (!ls)
+            break;
+
+        if (asyncmsg_redeliver(dev, ls))
+        {
+            struct asyncmsg_batch b = {
+                .buf = asyncmsg_data(&ls->msg),
+                .len = ls->msg.len,
+                .n = 1,
+                .prio = ls->prio,
+            };
+
+            save_to_dlq_db(dev, &b, 0, ASYNC_MSG_DLQ_LEASE_LOST);
+            asyncmsg_msg_free(&ls->msg);
+        }
+        asyncmsg_checkpoint_lane(dev, ls->prio, atomic64_read(&dev->lanes[ls->prio].head));
+        kfree(ls);
+    }
+
+    down(&dev->sem);
+    dev->lease_files--;
+    up(&dev->sem);
+    kfree(lt);
+    ctx->leases = NULL;
+}
+
+/* ASYNC_MSG_SET_VISIBILITY, under sem */
+static int asyncmsg_set_visibility(struct asyncmsg_file *ctx, u32 timeout_ms)
+{
+    struct asyncmsg_dev *dev = ctx->dev;
+    struct asyncmsg_leases *lt = ctx->leases;
+
+    if (dev->fanout)
+        return -EINVAL;
+    if (!lt)
+    {
+        if (!timeout_ms)
+            return 0;
+        lt = kzalloc(sizeof(*lt), GFP_KERNEL);
+        if (!lt)
+            return -ENOMEM;
+        lt->ctx = ctx;
+        INIT_LIST_HEAD(&lt->list);
+        hash_init(lt->hash);
+        hrtimer_setup(&lt->timer, asyncmsg_lease_timer_fn, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+        INIT_WORK(&lt->work, asyncmsg_lease_work_fn);
+        dev->lease_files++;
+        ctx->leases = lt;
+    }
+    WRITE_ONCE(lt->timeout_ms, timeout_ms);
+    return 0;
+}
+
+/*
+ * Checks framed records in buf and fills the batch with the complete ones.
+ * A batch goes to one lane, so it ends before the first record whose prio
+ * differs; records without ASYNC_MSG_REC_PRIO_SET take def_prio.
+ * Returns the number of bytes they cover.
+ */
+static ssize_t asyncmsg_parse_frames(struct asyncmsg_batch *b, const char *buf, size_t count,
+                                     unsigned int def_prio)
+{
+    size_t off = 0;
+
+    b->buf = buf;
+    b->n = 0;
+    b->framed = true;
+    b->ext = NULL;
+    b->keys = false;
+    while (count - off >= sizeof(struct asyncmsg_rec))
+    {
+        const struct asyncmsg_rec *rec = (const struct asyncmsg_rec *)(buf + off);
+        unsigned int prio = rec->flags & ASYNC_MSG_REC_PRIO_SET ?
+                            ASYNC_MSG_REC_PRIO(rec->flags) : def_prio;
+
+        if (rec->len > MAX_MSG_LEN || prio >= ASYNC_MSG_PRIO_LEVELS ||
+            ((rec->flags & ASYNC_MSG_REC_KEY) && rec->len < ASYNC_MSG_KEY_SIZE))
+        {
+            if (!b->n)
+                return rec->len > MAX_MSG_LEN ? -EMSGSIZE : -EINVAL;
+            break;
+        }
+        if (b->n && prio != b->prio)
+            break;
+        b->prio = prio;
+        if (sizeof(*rec) + rec->len > count - off)
+            break;
+        off += min(ASYNC_MSG_REC_SIZE(rec->len), count - off);
+        b->keys |= !!(rec->flags & ASYNC_MSG_REC_KEY);
+        b->n++;
+    }
+    if (!b->n)
+        return -EINVAL;
+    b->len = off;
+    return off;
+}
+
+static ssize_t asyncmsg_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct asyncmsg_file *ctx = iocb->ki_filp->private_data;
+    bool nonblock = (iocb->ki_flags & IOCB_NOWAIT) || (iocb->ki_filp->f_flags & O_NONBLOCK);
+    struct asyncmsg_batch batch = { };
+    size_t count = iov_iter_count(from);
+    char tmp[MSG_INLINE_LEN];
+    char *ext = NULL;
+    ssize_t ret;
+    char *buf;
+    int k;
+
+    /* нема токенів - нема сенсу щось копіювати */
+    if (!asyncmsg_rate_ready(ctx))
+    {
+        return -EAGAIN;
+    }
+
+    if (READ_ONCE(ctx->write_mode) == ASYNC_MSG_WRITE_RAW)
+    {
+        /* весь write()/writev() - одне повідомлення */
+        if (count > MAX_MSG_LEN)
+        {
+            return -EMSGSIZE;
+        }
+        /* великі повідомлення копіюємо одразу в буфер, який забере слот */
+        if (count > MSG_INLINE_LEN)
+        {
+            ext = asyncmsg_payload_alloc(count);
+            if (!ext)
+            {
+                return -ENOMEM;
+            }
+        }
+        buf = ext ? ext : tmp;
+        batch.buf = buf;
+        batch.len = count;
+        batch.n = 1;
+        batch.framed = false;
+        batch.prio = READ_ONCE(ctx->prio.prio);
+        batch.ext = ext ? &ext : NULL;
+        if(!copy_from_iter_full(buf, count, from))
+        {
+            asyncmsg_payload_free(ext, count);
+            return -EFAULT;
+        }
+
+        k = asyncmsg_enqueue(ctx, &batch, nonblock);
+        asyncmsg_payload_free(ext, count);
+        return k > 0 ? count : k;
+    }
+
+    count = min_t(size_t, count, MAX_WRITE_BATCH);
+    if (count < sizeof(struct asyncmsg_rec))
+    {
+        return -EINVAL;
+    }
+    buf = kvmalloc(count, GFP_KERNEL);
+    if (!buf)
+    {
+        return -ENOMEM;
+    }
+    if(!copy_from_iter_full(buf, count, from))
+    {
+        kvfree(buf);
+        return -EFAULT;
+    }
+
+    ret = asyncmsg_parse_frames(&batch, buf, count, READ_ONCE(ctx->prio.prio));
+    if (ret > 0 && asyncmsg_batch_prepare(&batch))
+    {
+        ret = -ENOMEM;
+    }
+    else if (ret > 0)
+    {
+        k = asyncmsg_enqueue(ctx, &batch, nonblock);
+        if (k <= 0)
+        {
+            ret = k;
+        }
+        else if (k < batch.n)
+        {
+            /* short write: report only the records that made it in */
+            size_t off = 0;
+            u32 len;
+
+            for (int i = 0; i < k; i++)
+                asyncmsg_batch_next(&batch, &off, &len);
+            ret = off;
+        }
+    }
+    asyncmsg_batch_release(&batch);
+    kvfree(buf);
+    return ret;
+}
+
+/*
+ * Layout of the mapping is in asyncmsg_uapi.h. The rings belong to the open
+ * file, mapping it again (e.g. after fork) shares them.
+ */
+static int asyncmsg_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct asyncmsg_file *ctx = file->private_data;
+    unsigned long len = vma->vm_end - vma->vm_start;
+    unsigned long ring_size;
+    struct asyncmsg_ring_ctl *ctl;
+    struct asyncmsg_frame *tx_frames;
+    void *mem;
+    int err;
+
+    /* the largest record has to fit even after a wrap */
+    BUILD_BUG_ON(ASYNC_MSG_RING_MIN < 2 * ASYNC_MSG_REC_SIZE(MAX_MSG_LEN));
+
+    if (vma->vm_pgoff || len <= PAGE_SIZE)
+        return -EINVAL;
+    ring_size = (len - PAGE_SIZE) / 2;
+    if (len != PAGE_SIZE + 2 * ring_size || !is_power_of_2(ring_size) ||
+        ring_size < ASYNC_MSG_RING_MIN || ring_size > ASYNC_MSG_RING_MAX)
+        return -EINVAL;
+
+    mutex_lock(&ctx->ring_lock);
+    if (ctx->ring_mem)
+    {
+        err = ring_size == ctx->ring_size ? remap_vmalloc_range(vma, ctx->ring_mem, 0) : -EBUSY;
+        mutex_unlock(&ctx->ring_lock);
+        return err;
+    }
+
+    mem = vmalloc_user(len);
+    tx_frames = kvmalloc_array(ASYNCMSG_TX_FRAMES, sizeof(*tx_frames), GFP_KERNEL);
+    if (!mem || !tx_frames)
+    {
+        err = -ENOMEM;
+        goto fail;
+    }
+    ctl = mem;
+    ctl->ring_size = ring_size;
+    ctl->tx_off = PAGE_SIZE;
+    ctl->rx_off = PAGE_SIZE + ring_size;
+
+    err = remap_vmalloc_range(vma, mem, 0);
+    if (err)
+        goto fail;
+
+    ctx->ring_mem = mem;
+    ctx->ring_ctl = ctl;
+    ctx->ring_size = ring_size;
+    ctx->tx_frames = tx_frames;
+    mutex_unlock(&ctx->ring_lock);
+    return 0;
+
+fail:
+    mutex_unlock(&ctx->ring_lock);
+    kvfree(tx_frames);
+    vfree(mem);
+    return err;
+}
+
+/*
+ * Queues the records userspace put between tx_head and tx_tail. Headers are
+ * read once and checked into ctx->tx_frames, payloads are copied from the
+ * shared pages straight into their slots. Like parse_frames() the batch ends
+ * before the first record of another lane.
+ */
+static int asyncmsg_ring_tx(struct asyncmsg_file *ctx, bool nonblock)
+{
+    struct asyncmsg_ring_ctl *ctl = ctx->ring_ctl;
+    const char *ring = (const char *)ctx->ring_mem + PAGE_SIZE;
+    u32 mask = ctx->ring_size - 1;
+    u32 head = ctx->tx_head;
+    u32 tail = smp_load_acquire(&ctl->tx_tail);
+    unsigned int def_prio = READ_ONCE(ctx->prio.prio);
+    struct asyncmsg_batch batch = { .framed = true, .frames = ctx->tx_frames };
+    size_t fill = 0;
+    int k;
+
+    if (tail - head > ctx->ring_size)
+        return -EINVAL;
+
+    while (head != tail && batch.n < ASYNCMSG_TX_FRAMES)
+    {
+        u32 rem = ctx->ring_size - (head & mask);
+        struct asyncmsg_frame *f = &ctx->tx_frames[batch.n];
+        unsigned int prio;
+        size_t size;
+
+        if (rem < sizeof(f->rec) || tail - head < sizeof(f->rec))
+        {
+            if (rem > tail - head)
+                goto bad;
+            head += rem;
+            continue;
+        }
+        memcpy(&f->rec, ring + (head & mask), sizeof(f->rec));
+        if (f->rec.flags & ASYNC_MSG_REC_PAD)
+        {
+            head += rem;
+            continue;
+        }
+        if (f->rec.len > MAX_MSG_LEN)
+            goto bad;
+        size = ASYNC_MSG_REC_SIZE(f->rec.len);
+        if (size > rem || size > tail - head)
+            goto bad;
+        prio = f->rec.flags & ASYNC_MSG_REC_PRIO_SET ? ASYNC_MSG_REC_PRIO(f->rec.flags) : def_prio;
+        if (prio >= ASYNC_MSG_PRIO_LEVELS ||
+            ((f->rec.flags & ASYNC_MSG_REC_KEY) && f->rec.len < ASYNC_MSG_KEY_SIZE))
+        {
+            if (!batch.n)
+                goto bad;
+            break;
+        }
+        if ((batch.n && prio != batch.prio) || fill + size > MAX_WRITE_BATCH)
+            break;
+
+        f->data = ring + (head & mask) + sizeof(f->rec);
+        if (f->rec.flags & ASYNC_MSG_REC_KEY)
+            f->key = asyncmsg_key(f->data);
+        head += size;
+        f->rec.seq = head;
+        batch.prio = prio;
+        batch.keys |= !!(f->rec.flags & ASYNC_MSG_REC_KEY);
+        batch.n++;
+        fill += size;
+    }
+
+    if (!batch.n)
+    {
+        /* nothing but padding */
+        ctx->tx_head = head;
+        smp_store_release(&ctl->tx_head, head);
+        return 0;
+    }
+
+    k = asyncmsg_batch_prepare(&batch);
+    if (!k)
+        k = asyncmsg_enqueue(ctx, &batch, nonblock);
+    asyncmsg_batch_release(&batch);
+    if (k <= 0)
+        return k;
+
+    head = ctx->tx_frames[k - 1].rec.seq;
+    ctx->tx_head = head;
+    smp_store_release(&ctl->tx_head, head);
+    return k;
+
+bad:
+    pr_info_ratelimited("asyncmsg%d: corrupt tx ring at %u\n", ctx->dev->index, head);
+    return -EINVAL;
+}
+
+/*
+ * Moves ready messages into the rx ring until it is full. Like a binary
+ * read, but the records go straight to the shared pages.
+ */
+static int asyncmsg_ring_rx(struct asyncmsg_file *ctx)
+{
+    struct asyncmsg_dev *dev = ctx->dev;
+    struct asyncmsg_ring_ctl *ctl = ctx->ring_ctl;
+    char *ring = (char *)ctx->ring_mem + PAGE_SIZE + ctx->ring_size;
+    u32 mask = ctx->ring_size - 1;
+    u32 tail = ctx->rx_tail;
+    u32 head = smp_load_acquire(&ctl->rx_head);
+    u64 next[ASYNC_MSG_PRIO_LEVELS];
+    u64 now = ktime_get_ns();
+    unsigned int freed;
+    bool skipped = false;
+    int n = 0, l;
+
+    if (tail - head > ctx->ring_size)
+        return -EINVAL;
+
+    if(down_interruptible(&dev->sem))
+    {
+        return -ERESTARTSYS;
+    }
+
+    l = asyncmsg_read_start(ctx, next);
+    if (l)
+    {
+        up(&dev->sem);
+        return l;
+    }
+    while ((l = asyncmsg_pick_lane(dev, ctx, next)) >= 0)
+    {
+        struct async_msg *msg = asyncmsg_slot(&dev->lanes[l], next[l]);
+        struct asyncmsg_rec rec;
+        u32 rem = ctx->ring_size - (tail & mask);
+        u32 size, need;
+
+        if (asyncmsg_read_skip(ctx, msg, l, now))
+        {
+            next[l]++;
+            skipped = true;
+            continue;
+        }
+        size = ASYNC_MSG_REC_SIZE(msg->len);
+        need = size > rem ? size + rem : size;
+        if (need > ctx->ring_size - (tail - head))
+            break;
+
+        if (size > rem)
+        {
+            if (rem >= sizeof(rec))
+            {
+                memset(&rec, 0, sizeof(rec));
+                rec.flags = ASYNC_MSG_REC_PAD;
+                memcpy(ring + (tail & mask), &rec, sizeof(rec));
+            }
+            tail += rem;
+        }
+
+        rec.len = msg->len;
+        rec.flags = l << ASYNC_MSG_REC_PRIO_SHIFT |
+                    (msg->redelivered ? ASYNC_MSG_REC_REDELIVERED : 0) |
+                    (msg->keyed ? ASYNC_MSG_REC_KEY : 0);
+        rec.seq = msg->seq;
+        rec.timestamp_ns = msg->timestamp_ns;
+        memcpy(ring + (tail & mask), &rec, sizeof(rec));
+        memcpy(ring + (tail & mask) + sizeof(rec), asyncmsg_data(msg), msg->len);
+        tail += size;
+        msg->processed = true;
+        next[l]++;
+        n++;
+    }
+
+    if (!n && !skipped)
+    {
+        up(&dev->sem);
+        return 0;
+    }
+
+    ctx->rx_tail = tail;
+    smp_store_release(&ctl->rx_tail, tail);
+    freed = asyncmsg_read_done(ctx, next);
+    up(&dev->sem);
+    asyncmsg_consumed(ctx, freed);
+
+    return n;
+}
+
+/* returns how many records moved in total */
+static long asyncmsg_ring_kick(struct asyncmsg_file *ctx, int what, bool nonblock)
+{
+    long moved = 0;
+    int ret = 0;
+
+    if (what & ~(ASYNC_MSG_KICK_TX | ASYNC_MSG_KICK_RX))
+        return -EINVAL;
+    if (mutex_lock_interruptible(&ctx->ring_lock))
+        return -ERESTARTSYS;
+    if (!ctx->ring_ctl)
+    {
+        mutex_unlock(&ctx->ring_lock);
+        return -ENXIO;
+    }
+
+    if (what & ASYNC_MSG_KICK_TX)
+    {
+        ret = asyncmsg_ring_tx(ctx, nonblock);
+        if (ret > 0)
+            moved += ret;
+    }
+    if (ret >= 0 && (what & ASYNC_MSG_KICK_RX))
+    {
+        ret = asyncmsg_ring_rx(ctx);
+        if (ret > 0)
+            moved += ret;
+    }
+    mutex_unlock(&ctx->ring_lock);
+
+    return moved ? moved : ret;
+}
+
+/* lives in io_uring_cmd->pdu while the command is parked */
+struct asyncmsg_uring_pdu {
+    struct list_head node;
+    union {
+        u64 addr;       /* dequeue: user buffer */
+        char *buf;      /* enqueue: records copied at submission */
+    };
+    union {
+        u32 len;
+        int res;        /* enqueue: what the command completes with, once buf is freed */
+    };
+    unsigned int prio;  /* enqueue: the lane it waits for room in */
+};
+static_assert(sizeof(struct asyncmsg_uring_pdu) <= sizeof_field(struct io_uring_cmd, pdu));
+
+static inline struct io_uring_cmd *asyncmsg_pdu_cmd(struct asyncmsg_uring_pdu *pdu)
+{
+    return (struct io_uring_cmd *)((char *)pdu - offsetof(struct io_uring_cmd, pdu));
+}
+
+/*
+ * Parks a command. What it waits for is checked again after the command is
+ * on the list, so a message or a free slot that showed up meanwhile is not
+ * missed: then the caller has to kick the list.
+ */
+static bool asyncmsg_uring_park(struct asyncmsg_dev *dev, struct io_uring_cmd *ioucmd,
+                                struct list_head *list, bool front)
+{
+    struct asyncmsg_uring_pdu *pdu = io_uring_cmd_to_pdu(ioucmd, struct asyncmsg_uring_pdu);
+
+    spin_lock(&dev->uring_lock);
+    if (front)
+        list_add(&pdu->node, list);
+    else
+        list_add_tail(&pdu->node, list);
+    spin_unlock(&dev->uring_lock);
+    smp_mb();
+
+    if (list == &dev->uring_rx)
+        return asyncmsg_ctx_ready(ioucmd->file->private_data);
+    return culc_free_space(dev, &dev->lanes[pdu->prio]) > 0;
+}
+
+static struct asyncmsg_uring_pdu *asyncmsg_uring_pop(struct asyncmsg_dev *dev, struct list_head *list)
+{
+    struct asyncmsg_uring_pdu *pdu;
+
+    smp_mb();
+    if (list_empty(list))
+        return NULL;
+    spin_lock(&dev->uring_lock);
+    pdu = list_first_entry_or_null(list, struct asyncmsg_uring_pdu, node);
+    if (pdu)
+        list_del_init(&pdu->node);
+    spin_unlock(&dev->uring_lock);
+    return pdu;
+}
+
+/*
+ * Queues the records, or returns -EIOCBQUEUED when the queue has no room
+ * yet. Unlike an O_NONBLOCK write() a full queue parks the command instead
+ * of sending it to the DLQ.
+ */
+static int asyncmsg_uring_try_enqueue(struct asyncmsg_file *ctx, struct asyncmsg_uring_pdu *pdu)
+{
+    struct asyncmsg_batch batch = { };
+    ssize_t ret;
+    int k;
+
+    ret = asyncmsg_parse_frames(&batch, pdu->buf, pdu->len, READ_ONCE(ctx->prio.prio));
+    if (ret <= 0)
+        return ret;
+    pdu->prio = batch.prio;
+    if (culc_free_space(ctx->dev, &ctx->dev->lanes[batch.prio]) == 0)
+        return -EIOCBQUEUED;
+    k = asyncmsg_batch_prepare(&batch);
+    if (!k)
+        k = asyncmsg_enqueue(ctx, &batch, true);
+    asyncmsg_batch_release(&batch);
+    if (k <= 0)
+        return k;
+
+    if (k < batch.n)
+    {
+        size_t off = 0;
+        u32 l;
+
+        for (int i = 0; i < k; i++)
+            asyncmsg_batch_next(&batch, &off, &l);
+        ret = off;
+    }
+    return ret;
+}
+
+/* io_uring_cmd_done() wants the ring's own issue_flags, so it runs from task work */
+static void asyncmsg_uring_tx_tw(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+    struct asyncmsg_uring_pdu *pdu = io_uring_cmd_to_pdu(ioucmd, struct asyncmsg_uring_pdu);
+
+    io_uring_cmd_done(ioucmd, pdu->res, issue_flags);
+}
+
+/*
+ * Retries parked enqueues in order until one still finds no room in its
+ * lane. It runs in whatever task freed the room, the completions are left to
+ * task work. A command parked again never kicks from here, room that showed
+ * up meanwhile is just another turn of the loop.
+ */
+static void asyncmsg_uring_kick_tx(struct asyncmsg_dev *dev)
+{
+    struct asyncmsg_uring_pdu *pdu;
+
+    while ((pdu = asyncmsg_uring_pop(dev, &dev->uring_tx)))
+    {
+        struct io_uring_cmd *ioucmd = asyncmsg_pdu_cmd(pdu);
+        int ret = asyncmsg_uring_try_enqueue(ioucmd->file->private_data, pdu);
+
+        if (ret == -EIOCBQUEUED)
+        {
+            if (!asyncmsg_uring_park(dev, ioucmd, &dev->uring_tx, true))
+                break;
+            continue;
+        }
+        kvfree(pdu->buf);
+        pdu->res = ret;
+        io_uring_cmd_complete_in_task(ioucmd, asyncmsg_uring_tx_tw);
+    }
+}
+
+/* runs in the submitter's context, so the user buffer can be written */
+static void asyncmsg_uring_rx_tw(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+    struct asyncmsg_uring_pdu *pdu = io_uring_cmd_to_pdu(ioucmd, struct asyncmsg_uring_pdu);
+    struct asyncmsg_file *ctx = ioucmd->file->private_data;
+    struct iov_iter iter;
+    ssize_t ret;
+
+    ret = import_ubuf(ITER_DEST, u64_to_user_ptr(pdu->addr), pdu->len, &iter);
+    if (!ret)
+        ret = asyncmsg_read_binary(ctx, &iter, true, true);
+    if (ret == -EAGAIN)
+    {
+        /* інший споживач забрав повідомлення першим або тримає sem */
+        if (asyncmsg_uring_park(ctx->dev, ioucmd, &ctx->dev->uring_rx, true))
+            asyncmsg_uring_kick_rx(ctx->dev);
+        return;
+    }
+    io_uring_cmd_done(ioucmd, ret, issue_flags);
+}
+
+/*
+ * Hands the head message to one parked dequeue, like an exclusive wakeup.
+ * In fan-out mode every parked dequeue gets a go, the ones whose cursor has
+ * nothing new park again.
+ */
+static void asyncmsg_uring_kick_rx(struct asyncmsg_dev *dev)
+{
+    struct asyncmsg_uring_pdu *pdu;
+    LIST_HEAD(all);
+
+    if (!READ_ONCE(dev->fanout))
+    {
+        pdu = asyncmsg_uring_pop(dev, &dev->uring_rx);
+        if (pdu)
+            io_uring_cmd_complete_in_task(asyncmsg_pdu_cmd(pdu), asyncmsg_uring_rx_tw);
+        return;
+    }
+
+    spin_lock(&dev->uring_lock);
+    list_splice_init(&dev->uring_rx, &all);
+    spin_unlock(&dev->uring_lock);
+    while ((pdu = list_first_entry_or_null(&all, struct asyncmsg_uring_pdu, node)))
+    {
+        list_del_init(&pdu->node);
+        io_uring_cmd_complete_in_task(asyncmsg_pdu_cmd(pdu), asyncmsg_uring_rx_tw);
+    }
+}
+
+static int asyncmsg_uring_cancel(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+    struct asyncmsg_uring_pdu *pdu = io_uring_cmd_to_pdu(ioucmd, struct asyncmsg_uring_pdu);
+    struct asyncmsg_file *ctx = ioucmd->file->private_data;
+    struct asyncmsg_dev *dev = ctx->dev;
+    bool parked;
+
+    spin_lock(&dev->uring_lock);
+    parked = !list_empty(&pdu->node);
+    if (parked)
+        list_del_init(&pdu->node);
+    spin_unlock(&dev->uring_lock);
+
+    /* not parked: a retry owns it and will complete it */
+    if (parked)
+    {
+        if (ioucmd->cmd_op == ASYNC_MSG_URING_ENQUEUE)
+            kvfree(pdu->buf);
+        io_uring_cmd_done(ioucmd, -ECANCELED, issue_flags);
+    }
+    return 0;
+}
+
+static int asyncmsg_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+    struct asyncmsg_uring_pdu *pdu = io_uring_cmd_to_pdu(ioucmd, struct asyncmsg_uring_pdu);
+    struct asyncmsg_file *ctx = ioucmd->file->private_data;
+    struct asyncmsg_dev *dev = ctx->dev;
+    const struct asyncmsg_uring_cmd *cmd;
+    struct iov_iter iter;
+    u64 addr;
+    u32 len;
+    int ret;
+    char *buf;
+
+    if (issue_flags & IO_URING_F_CANCEL)
+        return asyncmsg_uring_cancel(ioucmd, issue_flags);
+
+    /* the SQE can be reused once we return, take what we need now */
+    cmd = io_uring_sqe_cmd(ioucmd->sqe);
+    addr = READ_ONCE(cmd->addr);
+    len = READ_ONCE(cmd->len);
+    if (READ_ONCE(cmd->flags))
+        return -EINVAL;
+    INIT_LIST_HEAD(&pdu->node);
+
+    switch (ioucmd->cmd_op)
+    {
+    case ASYNC_MSG_URING_DEQUEUE:
+        ret = asyncmsg_bounce_alloc(ctx);
+        if (ret)
+            return ret;
+        ret = import_ubuf(ITER_DEST, u64_to_user_ptr(addr), len, &iter);
+        if (ret)
+            return ret;
+        ret = asyncmsg_read_binary(ctx, &iter, true, issue_flags & IO_URING_F_NONBLOCK);
+        if (ret != -EAGAIN)
+            return ret;
+        pdu->addr = addr;
+        pdu->len = len;
+        io_uring_cmd_mark_cancelable(ioucmd, issue_flags);
+        if (asyncmsg_uring_park(dev, ioucmd, &dev->uring_rx, false))
+            asyncmsg_uring_kick_rx(dev);
+        return -EIOCBQUEUED;
+
+    case ASYNC_MSG_URING_ENQUEUE:
+        len = min_t(u32, len, MAX_WRITE_BATCH);
+        if (len < sizeof(struct asyncmsg_rec))
+            return -EINVAL;
+        if (!asyncmsg_rate_ready(ctx))
+            return -EAGAIN;
+        buf = kvmalloc(len, GFP_KERNEL);
+        if (!buf)
+            return -ENOMEM;
+        if (copy_from_user(buf, u64_to_user_ptr(addr), len))
+        {
+            kvfree(buf);
+            return -EFAULT;
+        }
+        /* записи вже скопійовані, тож дописати їх можна з будь-якого контексту */
+        pdu->buf = buf;
+        pdu->len = len;
+        ret = asyncmsg_uring_try_enqueue(ctx, pdu);
+        if (ret != -EIOCBQUEUED)
+        {
+            kvfree(buf);
+            return ret;
+        }
+        io_uring_cmd_mark_cancelable(ioucmd, issue_flags);
+        if (asyncmsg_uring_park(dev, ioucmd, &dev->uring_tx, false))
+            asyncmsg_uring_kick_tx(dev);
+        return -EIOCBQUEUED;
+    }
+    return -ENOTTY;
+}
+
+/*
+ * ASYNC_MSG_GET_STATS: sums the per-CPU counters, no lock is taken so a
+ * collector can poll it as often as it likes.
+ */
+static long asyncmsg_get_stats(struct asyncmsg_dev *dev, struct asyncmsg_stats __user *uarg)
+{
+    struct asyncmsg_stats st = { };
+    u32 size, flags;
+    int cpu;
+
+    if (get_user(size, &uarg->size) || get_user(flags, &uarg->flags))
+        return -EFAULT;
+    if (size < offsetofend(struct asyncmsg_stats, size) || (flags & ~ASYNC_MSG_STATS_RESET_HWM))
+        return -EINVAL;
+    size = min_t(u32, size, sizeof(st));
+
+    for_each_possible_cpu(cpu)
+    {
+        const struct asyncmsg_pcpu_stats *p = per_cpu_ptr(dev->stats, cpu);
+
+        st.enqueued += p->enqueued;
+        st.dequeued += p->dequeued;
+        st.enqueued_bytes += p->enqueued_bytes;
+        st.dequeued_bytes += p->dequeued_bytes;
+        for (int i = 0; i < ASYNC_MSG_DLQ_REASONS; i++)
+            st.dlq[i] += p->dlq[i];
+        st.rate_limited += p->rate_limited;
+        st.wait_timeouts += p->wait_timeouts;
+        for (int i = 0; i < ASYNC_MSG_LAT_BUCKETS; i++)
+            st.lat_ns[i] += p->lat_ns[i];
+        st.expired += p->expired;
+        st.compacted += p->compacted;
+        st.filtered += p->filtered;
+    }
+
+    st.version = ASYNC_MSG_STATS_VERSION;
+    st.size = size;
+    st.flags = flags;
+    st.open_count = READ_ONCE(dev->open_count);
+    st.dlq_dropped = READ_ONCE(dev->dlq.dropped);
+    st.depth = asyncmsg_count(dev);
+    for (int l = 0; l < ASYNC_MSG_PRIO_LEVELS; l++)
+        st.lane_depth[l] = asyncmsg_lane_count(&dev->lanes[l]);
+    st.max_queue_size = READ_ONCE(dev->max_queue_size);
+    if (flags & ASYNC_MSG_STATS_RESET_HWM)
+        st.depth_hwm = atomic64_xchg(&dev->depth_hwm, st.depth);
+    else
+        st.depth_hwm = atomic64_read(&dev->depth_hwm);
+
+    if (copy_to_user(uarg, &st, size))
+        return -EFAULT;
+    return 0;
+}
+
+static void asyncmsg_key_free(void *ptr, void *arg)
+{
+    kfree(ptr);
+}
+
+/*
+ * ASYNC_MSG_SET_COMPACT. Turning it on indexes what is queued, the newest
+ * message of a key wins; turning it off drops the index. Under key_lock
+ * and sem.
+ */
+static int asyncmsg_set_compact(struct asyncmsg_dev *dev, bool on)
+{
+    int err;
+
+    if (on == dev->compact)
+        return 0;
+    if (!on)
+    {
+        dev->compact = false;
+        rhashtable_free_and_destroy(&dev->keys, asyncmsg_key_free, NULL);
+        return 0;
+    }
+
+    err = rhashtable_init(&dev->keys, &asyncmsg_key_params);
+    if (err)
+        return err;
+    dev->compact = true;
+    for (int l = 0; l < ASYNC_MSG_PRIO_LEVELS; l++)
+    {
+        struct asyncmsg_lane *lane = &dev->lanes[l];
+
+        for (u64 pos = atomic64_read(&lane->head); asyncmsg_pos_ready(lane, pos); pos++)
+        {
+            struct async_msg *msg = asyncmsg_slot(lane, pos);
+            struct asyncmsg_key_ent *ent, *old;
+
+            if (!msg->keyed)
+                continue;
+            ent = kzalloc(sizeof(*ent), GFP_KERNEL);
+            if (!ent)
+                continue;
+            ent->id.key = asyncmsg_key(asyncmsg_data(msg));
+            ent->id.prio = l;
+            ent->pos = pos;
+            old = rhashtable_lookup_get_insert_fast(&dev->keys, &ent->node, asyncmsg_key_params);
+            if (!IS_ERR_OR_NULL(old))
+                old->pos = pos;
+            if (old)
+                kfree(ent);
+        }
+    }
+    return 0;
+}
+
+/* ASYNC_MSG_LOOKUP: the value of a key as it is queued now, nothing is consumed */
+static long asyncmsg_lookup(struct asyncmsg_dev *dev, struct asyncmsg_lookup __user *uarg)
+{
+    struct asyncmsg_lookup req;
+    struct async_msg *msg = NULL;
+    u64 now = ktime_get_ns();
+    long err = 0;
+    int l;
+
+    if (copy_from_user(&req, uarg, sizeof(req)))
+        return -EFAULT;
+    if (down_interruptible(&dev->sem))
+        return -ERESTARTSYS;
+    if (!dev->compact)
+    {
+        up(&dev->sem);
+        return -ENOENT;
+    }
+    for (l = ASYNC_MSG_PRIO_LEVELS - 1; l >= 0; l--)
+    {
+        struct asyncmsg_key_ent *ent = asyncmsg_key_find(dev, l, req.key);
+
+        if (!ent)
+            continue;
+        msg = asyncmsg_slot(&dev->lanes[l], ent->pos);
+        if (!msg->expired && !asyncmsg_ttl_over(msg, now))
+            break;
+        msg = NULL;
+    }
+    if (!msg)
+    {
+        up(&dev->sem);
+        return -ENOENT;
+    }
+
+    if (req.len < msg->len)
+        err = -EMSGSIZE;
+    else if (copy_to_user(u64_to_user_ptr(req.addr), asyncmsg_data(msg), msg->len))
+        err = -EFAULT;
+    req.len = msg->len;
+    req.prio = l;
+    req.seq = msg->seq;
+    req.timestamp_ns = msg->timestamp_ns;
+    up(&dev->sem);
+
+    if (err != -EFAULT && copy_to_user(uarg, &req, sizeof(req)))
+        err = -EFAULT;
+    return err;
+}
+
+/* ASYNC_MSG_GET_CURSORS: one asyncmsg_cursor_stat per cursor, lag per lane */
+static long asyncmsg_get_cursors(struct asyncmsg_dev *dev, struct asyncmsg_cursor_list __user *uarg)
+{
+    struct asyncmsg_cursor_list req;
+    struct asyncmsg_cursor_stat __user *dst;
+    struct asyncmsg_cursor *cur;
+    long total = 0;
+    int err = 0;
+
+    if (copy_from_user(&req, uarg, sizeof(req)))
+        return -EFAULT;
+    dst = u64_to_user_ptr(req.addr);
+    req.count = 0;
+
+    if (down_interruptible(&dev->sem))
+        return -ERESTARTSYS;
+    list_for_each_entry(cur, &dev->cursors, node)
+    {
+        struct asyncmsg_cursor_stat cs = { .users = cur->users, .delivered = cur->delivered };
+
+        total++;
+        if ((req.count + 1) * sizeof(cs) > req.len)
+            continue;
+        memcpy(cs.group, cur->group, sizeof(cs.group));
+        for (int l = 0; l < ASYNC_MSG_PRIO_LEVELS; l++)
+        {
+            cs.lane_lag[l] = atomic64_read(&dev->lanes[l].tail) - cur->pos[l];
+            cs.lag += cs.lane_lag[l];
+        }
+        if (copy_to_user(dst + req.count, &cs, sizeof(cs)))
+        {
+            err = -EFAULT;
+            break;
+        }
+        req.count++;
+    }
+    up(&dev->sem);
+
+    if (err || put_user(req.count, &uarg->count))
+        return -EFAULT;
+    return total;
+}
+
+/*
+ * ASYNC_MSG_DLQ_READ: moves dead letters into the user buffer as binary
+ * records, reason in flags, position in the DLQ in seq.
+ */
+static long asyncmsg_dlq_read(struct asyncmsg_dev *dev, struct asyncmsg_dlq_read __user *uarg)
+{
+    struct asyncmsg_dlq_read req;
+    struct asyncmsg_dlq_ent ent;
+    char __user *dst;
+    size_t done = 0;
+    bool spilled;
+    u64 pos;
+
+    if (copy_from_user(&req, uarg, sizeof(req)))
+        return -EFAULT;
+    dst = u64_to_user_ptr(req.addr);
+    req.count = 0;
+
+    while (asyncmsg_dlq_pop(&dev->dlq, &ent, &pos, &spilled))
+    {
+        struct asyncmsg_rec rec = {
+            .len = ent.len,
+            .flags = ent.reason | ent.prio << ASYNC_MSG_REC_PRIO_SHIFT,
+            .seq = pos,
+            .timestamp_ns = ent.timestamp_ns,
+        };
+
+        if (ASYNC_MSG_REC_SIZE(ent.len) > req.len - done)
+        {
+            asyncmsg_dlq_unpop(&dev->dlq, &ent, spilled);
+            if (!done)
+                return -EMSGSIZE;
+            break;
+        }
+        if (copy_to_user(dst + done, &rec, sizeof(rec)) ||
+            copy_to_user(dst + done + sizeof(rec), ent.data, ent.len))
+        {
+            asyncmsg_dlq_unpop(&dev->dlq, &ent, spilled);
+            if (!done)
+                return -EFAULT;
+            break;
+        }
+        asyncmsg_payload_free(ent.data, ent.len);
+        done += ASYNC_MSG_REC_SIZE(ent.len);
+        req.count++;
+    }
+
+    if (put_user(req.count, &uarg->count))
+        return -EFAULT;
+    return done;
+}
+
+/*
+ * ASYNC_MSG_DLQ_REPLAY: oldest dead letters first, without waiting. It stops
+ * at the first one the queue does not take (full, rate limit) and leaves that
+ * one at the head of the DLQ.
+ */
+static long asyncmsg_dlq_replay(struct asyncmsg_file *ctx, int max)
+{
+    struct asyncmsg_dev *dev = ctx->dev;
+    struct asyncmsg_dlq_ent ent;
+    long done = 0;
+    long ret = 0;
+    bool spilled;
+    u64 pos;
+
+    while ((max <= 0 || done < max) && asyncmsg_dlq_pop(&dev->dlq, &ent, &pos, &spilled))
+    {
+        char *ext = ent.len > MSG_INLINE_LEN ? ent.data : NULL;
+        struct asyncmsg_batch batch = {
+            .buf = ent.data,
+            .len = ent.len,
+            .n = 1,
+            .ext = &ext,
+            .replay = true,
+            .prio = ent.prio,
+        };
+
+        ret = asyncmsg_enqueue(ctx, &batch, true);
+        if (ret <= 0)
+        {
+            asyncmsg_dlq_unpop(&dev->dlq, &ent, spilled);
+            break;
+        }
+        /* the slot took the buffer itself, or a copy when it fits inline */
+        if (!ext && ent.len <= MSG_INLINE_LEN)
+            asyncmsg_payload_free(ent.data, ent.len);
+        done++;
+    }
+    return done ? done : ret;
+}
+
+static long asyncmsg_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    int err = 0;
+    int tmp;
+    struct asyncmsg_file *ctx = file->private_data;
+    struct asyncmsg_dev *dev = ctx->dev;
+    struct asyncmsg_cursor *cur;
+
+    if(_IOC_TYPE(cmd) != ASYNC_MSG_IOC_MAGIC)
+    {
+        return -EINVAL;
+    }
+    if(_IOC_NR(cmd) > ASYNC_MSG_IOC_MXMR)
+    {
+        return -EINVAL;
+    }
+
+    if(_IOC_DIR(cmd) & _IOC_READ)
+    {
+        err = !access_ok((void __user *)arg, _IOC_SIZE(cmd));
+    }
+    else if(_IOC_DIR(cmd) & _IOC_WRITE)
+    {
+        err = !access_ok((void __user *)arg, _IOC_SIZE(cmd));
+    }
+    if(err)
+    {
+        return -EFAULT;
+    }
+
+    /* the size in the number follows struct asyncmsg_stats as the caller was built */
+    if(_IOC_NR(cmd) == _IOC_NR(ASYNC_MSG_GET_STATS) && _IOC_DIR(cmd) == (_IOC_READ | _IOC_WRITE))
+    {
+        return asyncmsg_get_stats(dev, (struct asyncmsg_stats __user *)arg);
+    }
+
+    switch(cmd)
+    {
+    case ASYNC_MSG_CLEAR_IO:
+        err = asyncmsg_lock_all(dev);
+        if(err)
+        {
+            return err;
+        }
+        /* все, що вже в лозі, вважається прочитаним */
+        for(int l = 0; l < ASYNC_MSG_PRIO_LEVELS; l++)
+        {
+            struct asyncmsg_lane *lane = &dev->lanes[l];
+            u64 tail = atomic64_read(&lane->tail);
+
+            asyncmsg_release_slots(dev, lane, atomic64_read(&lane->head), tail, false);
+            asyncmsg_checkpoint_lane(dev, l, tail);
+        }
+        list_for_each_entry(cur, &dev->cursors, node)
+            for(int l = 0; l < ASYNC_MSG_PRIO_LEVELS; l++)
+                WRITE_ONCE(cur->pos[l], atomic64_read(&dev->lanes[l].head));
+        asyncmsg_unlock_all(dev);
+        wake_up_all(&dev->write_q);
+        asyncmsg_notify(dev, ASYNC_MSG_EV_OUT);
+        asyncmsg_uring_kick_tx(dev);
+        break;
+    case ASYNC_MSG_SET_SIZE:
+        if(copy_from_user(&tmp, (int __user *)arg, sizeof(int)))
+        {
+            return -EFAULT;
+        }
+        if(tmp <= 0 || tmp >= MAX_QUEUE_LIMIT)
+        {
+            return -EINVAL;
+        }
+        err = asyncmsg_resize(dev, tmp);
+        if(err)
+        {
+            return err;
+        }
+        asyncmsg_notify(dev, ASYNC_MSG_EV_OUT);
+        asyncmsg_uring_kick_tx(dev);
+        printk(KERN_INFO "asyncmsg: changed max size of queue for : %d\n", dev->max_queue_size);
+        break;
+    case ASYNC_MSG_GET_SIZE:
+        tmp = dev->max_queue_size;
+        if (copy_to_user((int __user *)arg, &tmp, sizeof(int)))
+            return -EFAULT;
+        printk(KERN_INFO "asyncmsg: returned max buffer size : %d\n", dev->max_queue_size);
+        break;
+    case ASYNC_MSG_SYNC:
+        return asyncmsg_persist_sync(dev);
+    case ASYNC_MSG_SET_READ_MODE:
+        if(copy_from_user(&tmp, (int __user *)arg, sizeof(int)))
+        {
+            return -EFAULT;
+        }
+        if(tmp != ASYNC_MSG_READ_TEXT && tmp != ASYNC_MSG_READ_BINARY &&
+           tmp != ASYNC_MSG_READ_BINARY_CLASSES)
+        {
+            return -EINVAL;
+        }
+        if(tmp != ASYNC_MSG_READ_TEXT)
+        {
+            err = asyncmsg_bounce_alloc(ctx);
+            if(err)
+            {
+                return err;
+            }
+        }
+        WRITE_ONCE(ctx->read_mode, tmp);
+        break;
+    case ASYNC_MSG_SET_INTERVAL:
+        if(copy_from_user(&tmp, (int __user *)arg, sizeof(int)))
+        {
+            return -EFAULT;
+        }
+        if(tmp < 0)
+        {
+            return -EINVAL;
+        }
+        /* інтервал довший за секунду не можна виразити цілим rate */
+        asyncmsg_bucket_set(&dev->rate, (u64)tmp * NSEC_PER_MSEC,
+                            tmp ? DIV_ROUND_UP(MSEC_PER_SEC, tmp) : 0, 1);
+        printk(KERN_INFO "asyncmsg: set interval to %d ms \n", tmp);
+        break;
+    case ASYNC_MSG_SET_RATE:
+    {
+        struct asyncmsg_rate r;
+
+        if(copy_from_user(&r, (void __user *)arg, sizeof(r)))
+        {
+            return -EFAULT;
+        }
+        if(r.reserved || (r.scope != ASYNC_MSG_RATE_QUEUE && r.scope != ASYNC_MSG_RATE_FILE))
+        {
+            return -EINVAL;
+        }
+        asyncmsg_rate_set(r.scope == ASYNC_MSG_RATE_FILE ? &ctx->rate : &dev->rate, r.rate, r.burst);
+        break;
+    }
+    case ASYNC_MSG_SET_PRIO:
+    {
+        struct asyncmsg_prio pr;
+
+        if(copy_from_user(&pr, (void __user *)arg, sizeof(pr)))
+        {
+            return -EFAULT;
+        }
+        if(pr.prio >= ASYNC_MSG_PRIO_LEVELS ||
+           (pr.policy != ASYNC_MSG_PRIO_STRICT && pr.policy != ASYNC_MSG_PRIO_WEIGHTED))
+        {
+            return -EINVAL;
+        }
+        /* readers walk the weighted round under sem, start it over there */
+        if(down_interruptible(&dev->sem))
+        {
+            return -ERESTARTSYS;
+        }
+        ctx->prio = pr;
+        ctx->rr_lane = 0;
+        ctx->rr_credit = 0;
+        up(&dev->sem);
+        /* the lane poll() judges POLLOUT on may have changed */
+        asyncmsg_notify(dev, ASYNC_MSG_EV_OUT);
+        break;
+    }
+    case ASYNC_MSG_SET_FANOUT:
+        if(copy_from_user(&tmp, (int __user *)arg, sizeof(int)))
+        {
+            return -EFAULT;
+        }
+        if(tmp != 0 && tmp != 1)
+        {
+            return -EINVAL;
+        }
+        if(down_interruptible(&dev->sem))
+        {
+            return -ERESTARTSYS;
+        }
+        /* курсори тримають повідомлення, без них shared режим їх би просто з'їв */
+        if(!tmp && (!list_empty(&dev->cursors) || dev->skip_filters))
+        {
+            err = -EBUSY;
+        }
+        else if(tmp && dev->lease_files)
+        {
+            err = -EBUSY;
+        }
+        else
+        {
+            WRITE_ONCE(dev->fanout, tmp);
+        }
+        up(&dev->sem);
+        return err;
+    case ASYNC_MSG_SUBSCRIBE:
     {
-        save_to_dlq_db(tmp, count, "queue_full_hard_limit");
-        return -ENOSPC;
-    }
+        struct asyncmsg_subscribe sub;
 
-    /* 3. Очікуємо на вільне місце. Якщо таймаут - пишемо в DLQ */
-    ret = wait_event_interruptible_timeout(dev->write_q, culc_free_space(dev) > 0, msecs_to_jiffies(15000));
-    if(ret == 0)
-    {
-        save_to_dlq_db(tmp, count, "wait_timeout");
-        return 0;
-    }
-    else if(ret < 0)
-    {
-        return -EFAULT;
+        if(copy_from_user(&sub, (void __user *)arg, sizeof(sub)))
+        {
+            return -EFAULT;
+        }
+        if(sub.reserved || (sub.flags & ~ASYNC_MSG_SUB_LATEST) ||
+           !memchr(sub.group, 0, sizeof(sub.group)))
+        {
+            return -EINVAL;
+        }
+        if(down_interruptible(&dev->sem))
+        {
+            return -ERESTARTSYS;
+        }
+        err = dev->fanout ? asyncmsg_cursor_get(ctx, sub.group, sub.flags) : -EINVAL;
+        up(&dev->sem);
+        return err;
     }
-
-    /* 4. Беремо семафор для запису */
-    if(down_interruptible(&dev->sem))
+    case ASYNC_MSG_GET_CURSORS:
+        return asyncmsg_get_cursors(dev, (struct asyncmsg_cursor_list __user *)arg);
+    case ASYNC_MSG_SET_VISIBILITY:
     {
-        return -ERESTARTSYS;
-    }
+        struct asyncmsg_visibility vis;
 
-    /* 5. Перевіряємо затримку (rate limit). Якщо зарано - пишемо в DLQ */
-    if(dev->last_jiffies && time_before(curr_jiffies, dev->last_jiffies + msecs_to_jiffies(dev->write_delay_ms)))
-    {
-        printk(KERN_INFO "asyncmsg: not so fast. we have delay : %d ms, between writes\n", dev->write_delay_ms);
-        save_to_dlq_db(tmp, count, "rate_limit_exceeded");
+        if(copy_from_user(&vis, (void __user *)arg, sizeof(vis)))
+        {
+            return -EFAULT;
+        }
+        if(vis.reserved)
+        {
+            return -EINVAL;
+        }
+        if(down_interruptible(&dev->sem))
+        {
+            return -ERESTARTSYS;
+        }
+        err = asyncmsg_set_visibility(ctx, vis.timeout_ms);
         up(&dev->sem);
-        return -EAGAIN;
+        return err;
     }
-
-    /* ТУТ ВЖЕ ВСЕ ДОБРЕ. Створюємо повідомлення і додаємо в основну БД */
-    new_mess = mempool_alloc(dev->asyncmsg_mempool, GFP_KERNEL);
-    memcpy(new_mess->msg, tmp, count);
-    new_mess->timestamp_ns = ktime_get_ns();
-    new_mess->len = count;
-    new_mess->processed = false;
-
-    dev->queue[dev->tail] = new_mess;
-    dev->tail++;
-    dev->free_messages++;
-    dev->last_jiffies = curr_jiffies;
-
-    /* Зберігаємо в основний лог і оновлюємо метрику */
-    save_to_json_db(new_mess);
-    save_meta_db(dev);
-
-    if(dev->fasync_queue)
+    case ASYNC_MSG_ACK:
+        return asyncmsg_ack(ctx, (const struct asyncmsg_ack __user *)arg);
+    case ASYNC_MSG_SET_COMPACT:
+        if(copy_from_user(&tmp, (int __user *)arg, sizeof(int)))
+        {
+            return -EFAULT;
+        }
+        if(tmp != 0 && tmp != 1)
+        {
+            return -EINVAL;
+        }
+        if(mutex_lock_interruptible(&dev->key_lock))
+        {
+            return -ERESTARTSYS;
+        }
+        if(down_interruptible(&dev->sem))
+        {
+            mutex_unlock(&dev->key_lock);
+            return -ERESTARTSYS;
+        }
+        err = asyncmsg_set_compact(dev, tmp);
+        up(&dev->sem);
+        mutex_unlock(&dev->key_lock);
+        return err;
+    case ASYNC_MSG_LOOKUP:
+        return asyncmsg_lookup(dev, (struct asyncmsg_lookup __user *)arg);
+    case ASYNC_MSG_SET_FILTER:
     {
-        kill_fasync(&dev->fasync_queue, SIGIO, POLL_IN);
-    }
-
-    wake_up(&dev->read_q);
-    up(&dev->sem);
-    tasklet_schedule(&dev->msg_tasklet);
-
-    return count;
-}
-
-static long asyncmsg_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
-{
-    int err = 0;
-    int tmp;
-    struct asyncmsg_dev *dev = file->private_data;
+        struct asyncmsg_filter f;
+        u32 pat = ASYNC_MSG_FILTER_AT | ASYNC_MSG_FILTER_ANYWHERE;
+        u32 cond = ASYNC_MSG_FILTER_KEY | pat;
+        unsigned long flags;
 
-    if(_IOC_TYPE(cmd) != ASYNC_MSG_IOC_MAGIC)
-    {
-        return -EINVAL;
+        if(copy_from_user(&f, (void __user *)arg, sizeof(f)))
+        {
+            return -EFAULT;
+        }
+        if((f.flags & ~(cond | ASYNC_MSG_FILTER_DROP)) || (f.flags & pat) == pat ||
+           ((f.flags & ASYNC_MSG_FILTER_DROP) && !(f.flags & cond)) ||
+           (f.prio_mask >> ASYNC_MSG_PRIO_LEVELS) || f.offset > MAX_MSG_LEN ||
+           ((f.flags & pat) ? !f.len || f.len > ASYNC_MSG_FILTER_LEN : f.len))
+        {
+            return -EINVAL;
+        }
+        if(down_interruptible(&dev->sem))
+        {
+            return -ERESTARTSYS;
+        }
+        /* у shared черзі пропустити повідомлення означає його з'їсти */
+        if(asyncmsg_filter_skips(&f) && !dev->fanout)
+        {
+            up(&dev->sem);
+            return -EINVAL;
+        }
+        dev->skip_filters += asyncmsg_filter_skips(&f) - asyncmsg_filter_skips(&ctx->filter);
+        spin_lock_irqsave(&dev->lock, flags);
+        ctx->filter = f;
+        /* вердикти старого фільтра більше не дійсні */
+        ctx->filter_gen = dev->filter_gen - 1;
+        spin_unlock_irqrestore(&dev->lock, flags);
+        up(&dev->sem);
+        /* a wider filter may let through what is queued already */
+        wake_up_all(&dev->read_q);
+        asyncmsg_uring_kick_rx(dev);
+        break;
     }
-    if(_IOC_NR(cmd) > ASYNC_MSG_IOC_MXMR)
+    case ASYNC_MSG_SET_TTL:
     {
-        return -EINVAL;
-    }
+        struct asyncmsg_ttl ttl;
 
-    if(_IOC_DIR(cmd) & _IOC_READ)
-    {
-        err = !access_ok((void __user *)arg, _IOC_SIZE(cmd));
+        if(copy_from_user(&ttl, (void __user *)arg, sizeof(ttl)))
+        {
+            return -EFAULT;
+        }
+        if(ttl.reserved || (ttl.flags & ~ASYNC_MSG_TTL_DLQ) ||
+           (ttl.sweep_ms && ttl.sweep_ms < ASYNCMSG_SWEEP_MIN_MS))
+        {
+            return -EINVAL;
+        }
+        WRITE_ONCE(dev->sweep_ms, ttl.sweep_ms ? ttl.sweep_ms : ASYNCMSG_SWEEP_MS);
+        WRITE_ONCE(dev->ttl_flags, ttl.flags);
+        WRITE_ONCE(dev->ttl_ms, ttl.ttl_ms);
+        /* a new interval applies from now, not after the old one runs out */
+        if(READ_ONCE(dev->ttl_used))
+        {
+            mod_timer(&dev->stat_timer, jiffies + msecs_to_jiffies(dev->sweep_ms));
+        }
+        break;
     }
-    else if(_IOC_DIR(cmd) & _IOC_WRITE)
+    case ASYNC_MSG_SET_WRITE_MODE:
+        if(copy_from_user(&tmp, (int __user *)arg, sizeof(int)))
+        {
+            return -EFAULT;
+        }
+        if(tmp != ASYNC_MSG_WRITE_RAW && tmp != ASYNC_MSG_WRITE_FRAMED)
+        {
+            return -EINVAL;
+        }
+        WRITE_ONCE(ctx->write_mode, tmp);
+        break;
+    case ASYNC_MSG_SET_TIMEOUTS:
     {
-        err = !access_ok((void __user *)arg, _IOC_SIZE(cmd));
+        struct asyncmsg_timeouts t;
+
+        if(copy_from_user(&t, (void __user *)arg, sizeof(t)))
+        {
+            return -EFAULT;
+        }
+        if(t.reserved || t.busy_poll_us > ASYNC_MSG_BUSY_POLL_MAX_US)
+        {
+            return -EINVAL;
+        }
+        WRITE_ONCE(ctx->timeouts.read_ms, t.read_ms);
+        WRITE_ONCE(ctx->timeouts.write_ms, t.write_ms);
+        WRITE_ONCE(ctx->timeouts.busy_poll_us, t.busy_poll_us);
+        break;
     }
-    if(err)
+    case ASYNC_MSG_SET_WATERMARKS:
     {
-        return -EFAULT;
-    }
-
+        struct asyncmsg_watermarks wm;
 
-    switch(cmd)
+        if(copy_from_user(&wm, (void __user *)arg, sizeof(wm)))
+        {
+            return -EFAULT;
+        }
+        if(wm.reserved)
+        {
+            return -EINVAL;
+        }
+        WRITE_ONCE(ctx->wm.rx_lowat, wm.rx_lowat);
+        WRITE_ONCE(ctx->wm.rx_max_delay_us, wm.rx_max_delay_us);
+        WRITE_ONCE(ctx->wm.tx_lowat, wm.tx_lowat);
+        /* нові пороги могли вже виконатись */
+        wake_up_all(&dev->read_q);
+        wake_up_all(&dev->write_q);
+        asyncmsg_notify(dev, ASYNC_MSG_EV_IN | ASYNC_MSG_EV_OUT);
+        break;
+    }
+    case ASYNC_MSG_SET_EVENTFD:
     {
-    case ASYNC_MSG_CLEAR_IO:
-        dev->head = 0;
-        dev->free_messages = 0;
+        struct asyncmsg_eventfd efd;
 
-        for(int i = 0; i < dev->tail; i++)
+        if(copy_from_user(&efd, (void __user *)arg, sizeof(efd)))
         {
-            mempool_free(dev->queue[i], dev->asyncmsg_mempool);
-            dev->queue[i] = NULL;
+            return -EFAULT;
         }
-        dev->tail = 0;
-        break;
-    case ASYNC_MSG_SET_SIZE:
+        return asyncmsg_efd_set(ctx, &efd);
+    }
+    case ASYNC_MSG_DLQ_READ:
+        return asyncmsg_dlq_read(dev, (struct asyncmsg_dlq_read __user *)arg);
+    case ASYNC_MSG_DLQ_REPLAY:
         if(copy_from_user(&tmp, (int __user *)arg, sizeof(int)))
         {
             return -EFAULT;
         }
-        if(tmp <= 0 || tmp >= 4096)
+        return asyncmsg_dlq_replay(ctx, tmp);
+    case ASYNC_MSG_RING_KICK:
+        if(copy_from_user(&tmp, (int __user *)arg, sizeof(int)))
         {
-            return -EINVAL;
+            return -EFAULT;
         }
-        dev->max_queue_size = tmp;
-        printk(KERN_INFO "asyncmsg: changed max size of queue for : %d\n", dev->max_queue_size);
-        break;
-    case ASYNC_MSG_GET_SIZE:
-        tmp = dev->max_queue_size;
-        if (copy_to_user((int __user *)arg, &tmp, sizeof(int)))
+        return asyncmsg_ring_kick(ctx, tmp, file->f_flags & O_NONBLOCK);
+    case ASYNC_MSG_CREATE_QUEUE:
+        tmp = asyncmsg_add_queue();
+        if(tmp < 0)
+        {
+            return tmp;
+        }
+        if(copy_to_user((int __user *)arg, &tmp, sizeof(int)))
+        {
             return -EFAULT;
-        printk(KERN_INFO "asyncmsg: returned max buffer size : %d\n", dev->max_queue_size);
+        }
         break;
     case ASYNC_MSG_GET_STAT:
+        /* legacy text line, every value is read without a lock like in GET_STATS */
         char tmp[RETURN_MESSAGE];   
         int len;
-        unsigned long flags;
 
-        spin_lock_irqsave(&dev->lock, flags);
         len = snprintf(tmp, sizeof(tmp),
                     "asyncmsg: "
-                    "head=%d tail=%d free=%d open=%d delay_ms=%d max size=%d\n",
-                    dev->head, 
-                    dev->tail,
-                    dev->free_messages,
+                    "lanes=%u/%u/%u/%u free=%u open=%d rate=%u/s burst=%u max size=%d dlq=%llu dlq dropped=%llu\n",
+                    asyncmsg_lane_count(&dev->lanes[0]),
+                    asyncmsg_lane_count(&dev->lanes[1]),
+                    asyncmsg_lane_count(&dev->lanes[2]),
+                    asyncmsg_lane_count(&dev->lanes[3]),
+                    asyncmsg_count(dev),
                     dev->open_count,
-                    dev->write_delay_ms,
-                    dev->max_queue_size);
-        spin_unlock_irqrestore(&dev->lock, flags);
+                    dev->rate.rate,
+                    dev->rate.burst,
+                    dev->max_queue_size,
+                    READ_ONCE(dev->dlq.tail) - READ_ONCE(dev->dlq.head),
+                    READ_ONCE(dev->dlq.dropped));
 
         if(copy_to_user((char __user*)arg, tmp, len))
         {
@@ -357,137 +4587,379 @@ static long asyncmsg_ioctl(struct file *file, unsigned int cmd, unsigned long ar
 
 static __poll_t asyncmsg_poll(struct file *file, struct poll_table_struct *wait)
 {
-    struct asyncmsg_dev *dev = file->private_data;
+    struct asyncmsg_file *ctx = file->private_data;
+    struct asyncmsg_dev *dev = ctx->dev;
     __poll_t mask = 0;
 
     poll_wait(file, &dev->read_q, wait);
     poll_wait(file, &dev->write_q, wait);
 
-    if(dev->free_messages > 0)
+    if(asyncmsg_readable(ctx))
     {
         mask |= POLLIN | POLLRDNORM;
     }
-    if(culc_free_space(dev) > 0)
+    else
+    {
+        asyncmsg_rx_arm(ctx);
+    }
+    if(asyncmsg_writable(ctx))
     {
         mask |= POLLOUT | POLLWRNORM;
     }
+    for(int l = 1; l < ASYNC_MSG_PRIO_LEVELS; l++)
+    {
+        if(asyncmsg_lane_wanted(ctx, l) && asyncmsg_pos_ready(&dev->lanes[l], asyncmsg_read_pos(ctx, l)))
+        {
+            mask |= POLLPRI;
+            break;
+        }
+    }
 
     return mask;
 }
 
+/*
+ * Sweep, once TTLs are in use, and the stats line. The sweep itself needs
+ * sem, so it runs as ttl_work.
+ */
 static void asyncmsg_timer_fn(struct timer_list *t)
 {
     struct asyncmsg_dev *dev = timer_container_of(dev, t, stat_timer);
+    bool sweep = READ_ONCE(dev->ttl_used);
     unsigned long flags;
 
+    if (sweep)
+        queue_work(dev->wq, &dev->ttl_work);
+    if (time_before(jiffies, dev->stat_next))
+        goto rearm;
+    dev->stat_next = jiffies + msecs_to_jiffies(ASYNCMSG_STAT_MS);
+
     spin_lock_irqsave(&dev->lock, flags);
-    pr_info_ratelimited("asyncmsg: "
-                    "head=%d tail=%d free=%d open=%d delay_ms=%d max size=%d\n",
-                    dev->head, 
-                    dev->tail,
-                    dev->free_messages,
+    pr_info_ratelimited("asyncmsg%d: "
+                    "lanes=%u/%u/%u/%u free=%u open=%d rate=%u/s burst=%u max size=%d\n",
+                    dev->index,
+                    asyncmsg_lane_count(&dev->lanes[0]),
+                    asyncmsg_lane_count(&dev->lanes[1]),
+                    asyncmsg_lane_count(&dev->lanes[2]),
+                    asyncmsg_lane_count(&dev->lanes[3]),
+                    asyncmsg_count(dev),
                     dev->open_count,
-                    dev->write_delay_ms,
+                    dev->rate.rate,
+                    dev->rate.burst,
                     dev->max_queue_size);
     spin_unlock_irqrestore(&dev->lock, flags);
 
-    mod_timer(&dev->stat_timer, jiffies + msecs_to_jiffies(600000));
+rearm:
+    mod_timer(&dev->stat_timer, jiffies +
+              msecs_to_jiffies(sweep ? READ_ONCE(dev->sweep_ms) : ASYNCMSG_STAT_MS));
 }
 
-static void asyncmsg_tasklet_fn(unsigned long arg)
+/*
+ * TTL sweep: frees the expired messages at the front of every lane, so a
+ * queue nobody reads does not stay full of them. Expired ones behind a
+ * live message wait for the readers to skip them. In fan-out mode cursors
+ * still short of the expired run are moved past it first.
+ */
+static void asyncmsg_ttl_work_fn(struct work_struct *work)
 {
-    struct asyncmsg_dev *dev = (struct asyncmsg_dev *)arg;
-    int letter_counter = 0;
+    struct asyncmsg_dev *dev = container_of(work, struct asyncmsg_dev, ttl_work);
+    u64 end[ASYNC_MSG_PRIO_LEVELS];
+    u64 now = ktime_get_ns();
+    struct asyncmsg_cursor *cur;
+    unsigned int freed = 0;
+    bool any = false;
 
-    if (dev->tail > 0 && dev->queue[dev->tail - 1]) {
-        char *tmp = dev->queue[dev->tail - 1]->msg;
-        while (*tmp != '\0') {
-            if ((*tmp >= 'a' && *tmp <= 'z') || (*tmp >= 'A' && *tmp <= 'Z')) {
-                letter_counter++;
-            }
-            tmp++;
+    down(&dev->sem);
+    for (int l = 0; l < ASYNC_MSG_PRIO_LEVELS; l++)
+    {
+        struct asyncmsg_lane *lane = &dev->lanes[l];
+        u64 head = atomic64_read(&lane->head);
+        u64 pos = head;
+
+        while (asyncmsg_pos_ready(lane, pos) && asyncmsg_expire(dev, asyncmsg_slot(lane, pos), l, now))
+            pos++;
+        end[l] = pos;
+        any |= pos != head;
+    }
+    if (any && list_empty(&dev->cursors))
+    {
+        freed = asyncmsg_consume_lanes(dev, end);
+    }
+    else if (any)
+    {
+        list_for_each_entry(cur, &dev->cursors, node)
+            for (int l = 0; l < ASYNC_MSG_PRIO_LEVELS; l++)
+                if (cur->pos[l] < end[l])
+                    WRITE_ONCE(cur->pos[l], end[l]);
+        freed = asyncmsg_reclaim(dev);
+    }
+    up(&dev->sem);
+
+    asyncmsg_freed(dev, freed);
+}
+
+/*
+ * Classify stage: up to ASYNCMSG_CLS_CHUNK messages published since the last
+ * chunk, over all lanes and the highest lane first. sem is held so no
+ * consumer frees a slot under it. Readers that get to a message first
+ * classify it themselves.
+ */
+static unsigned int asyncmsg_cls_chunk(struct asyncmsg_dev *dev)
+{
+    unsigned int n = 0;
+
+    down(&dev->sem);
+    for (int l = ASYNC_MSG_PRIO_LEVELS - 1; l >= 0 && n < ASYNCMSG_CLS_CHUNK; l--)
+    {
+        struct asyncmsg_lane *lane = &dev->lanes[l];
+        u64 pos, first, bytes = 0;
+        unsigned int k = 0;
+
+        pos = max_t(u64, lane->cls_pos, atomic64_read(&lane->head));
+        first = pos;
+        for (; n < ASYNCMSG_CLS_CHUNK && asyncmsg_pos_ready(lane, pos); pos++, n++, k++)
+        {
+            struct async_msg *msg = asyncmsg_slot(lane, pos);
+
+            if (!msg->classified)
+                asyncmsg_classify(msg);
+            bytes += msg->len;
         }
-        printk(KERN_INFO "asyncmsg: got message with %d letters\n", letter_counter);
+        lane->cls_pos = pos;
+        if (k)
+            trace_asyncmsg_process(dev->index, asyncmsg_pos_seq(lane, first), k, bytes);
     }
+    up(&dev->sem);
+    return n;
+}
+
+/* one pass: chunks with sem dropped in between, so readers wait for one chunk at most */
+static void asyncmsg_cls_work_fn(struct work_struct *work)
+{
+    struct asyncmsg_dev *dev = container_of(work, struct asyncmsg_dev, cls_work);
+    unsigned int n = 0, k;
+
+    do {
+        k = asyncmsg_cls_chunk(dev);
+        n += k;
+        cond_resched();
+    } while (k == ASYNCMSG_CLS_CHUNK && n < ASYNCMSG_CLS_BATCH);
+
+    /* let other work on this queue in between long bursts */
+    if (k == ASYNCMSG_CLS_CHUNK)
+        queue_work(dev->wq, &dev->cls_work);
 }
 
 static struct file_operations asyncmsg_fops = {
     .owner = THIS_MODULE,
     .open = asyncmsg_open,
     .release = asyncmsg_release,
-    .read = asyncmsg_read,
-    .write = asyncmsg_write,
+    .read_iter = asyncmsg_read_iter,
+    .write_iter = asyncmsg_write_iter,
+    .splice_read = copy_splice_read,
+    .splice_write = iter_file_splice_write,
+    .mmap = asyncmsg_mmap,
+    .uring_cmd = asyncmsg_uring_cmd,
     .unlocked_ioctl = asyncmsg_ioctl,
     .fasync = asyncmsg_fasync,
     .poll = asyncmsg_poll,
 };
 
-static int __init asyncmsg_init(void)
+static void asyncmsg_lanes_free(struct asyncmsg_dev *dev)
+{
+    for (int l = 0; l < ASYNC_MSG_PRIO_LEVELS; l++)
+    {
+        struct asyncmsg_lane *lane = &dev->lanes[l];
+
+        if (!lane->queue)
+            continue;
+        for (u64 pos = atomic64_read(&lane->head); pos < atomic64_read(&lane->tail); pos++)
+            asyncmsg_msg_free(asyncmsg_slot(lane, pos));
+        kvfree(lane->queue);
+        kvfree(lane->replay_seq);
+    }
+}
+
+/* every lane numbers its messages in its own seq range, see ASYNCMSG_SEQ_LANE */
+static int asyncmsg_lanes_alloc(struct asyncmsg_dev *dev)
+{
+    for (int l = 0; l < ASYNC_MSG_PRIO_LEVELS; l++)
+    {
+        struct asyncmsg_lane *lane = &dev->lanes[l];
+
+        lane->queue = asyncmsg_ring_alloc(dev->max_queue_size, &lane->ring_mask);
+        if (!lane->queue)
+        {
+            asyncmsg_lanes_free(dev);
+            return -ENOMEM;
+        }
+        lane->seq_base = (u64)l << ASYNCMSG_LANE_SHIFT;
+    }
+    return 0;
+}
+
+static void asyncmsg_free_queue(struct asyncmsg_dev *dev)
+{
+    timer_delete_sync(&dev->stat_timer);
+    cancel_work_sync(&dev->ttl_work);
+    cancel_work_sync(&dev->cls_work);
+    asyncmsg_set_compact(dev, false);
+    asyncmsg_dlq_exit(dev);
+    asyncmsg_persist_exit(dev);
+    free_percpu(dev->stats);
+    percpu_free_rwsem(&dev->resize_sem);
+    asyncmsg_lanes_free(dev);
+    kfree(dev);
+}
+
+/* builds a queue with its own ring, locks, wait queues and files, and exposes it as /dev/asyncmsg<index> */
+static struct asyncmsg_dev *asyncmsg_create_queue(int index)
 {
+    struct asyncmsg_dev *dev;
+    struct device *device;
+    dev_t devno = MKDEV(asyncmsg_major, index);
     int err;
-    err = alloc_chrdev_region(&asyncmsg_devno, 0, 1, "asyncmsg");
-    asyncmsg_major = MAJOR(asyncmsg_devno);
-    if(err < 0)
+
+    dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+    if (!dev)
+        return ERR_PTR(-ENOMEM);
+
+    dev->index = index;
+    snprintf(dev->log_path, sizeof(dev->log_path), DB_LOG_PATH, index);
+    snprintf(dev->ckpt_path, sizeof(dev->ckpt_path), DB_CKPT_PATH, index);
+    snprintf(dev->dlq_path, sizeof(dev->dlq_path), DB_DLQ_PATH, index);
+
+    dev->max_queue_size = MAX_QUEUE_SIZE;
+    if (asyncmsg_lanes_alloc(dev)) {
+        printk(KERN_ERR "asyncmsg%d: failed to allocate queue\n", index);
+        kfree(dev);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    err = percpu_init_rwsem(&dev->resize_sem);
+    if (err) {
+        asyncmsg_lanes_free(dev);
+        kfree(dev);
+        return ERR_PTR(err);
+    }
+    sema_init(&dev->sem, 1);
+    mutex_init(&dev->key_lock);
+    INIT_LIST_HEAD(&dev->cursors);
+    spin_lock_init(&dev->lease_lock);
+    for (int l = 0; l < ASYNC_MSG_PRIO_LEVELS; l++)
+        INIT_LIST_HEAD(&dev->leases[l]);
+    spin_lock_init(&dev->lock);
+    init_waitqueue_head(&dev->read_q);
+    init_waitqueue_head(&dev->write_q);
+    INIT_LIST_HEAD(&dev->efd_list);
+    spin_lock_init(&dev->efd_lock);
+    INIT_LIST_HEAD(&dev->uring_rx);
+    INIT_LIST_HEAD(&dev->uring_tx);
+    spin_lock_init(&dev->uring_lock);
+
+    dev->sweep_ms = ASYNCMSG_SWEEP_MS;
+    INIT_WORK(&dev->ttl_work, asyncmsg_ttl_work_fn);
+    dev->stat_next = jiffies + msecs_to_jiffies(ASYNCMSG_STAT_MS);
+    timer_setup(&dev->stat_timer, asyncmsg_timer_fn, 0);
+    mod_timer(&dev->stat_timer, dev->stat_next);
+
+    INIT_WORK(&dev->cls_work, asyncmsg_cls_work_fn);
+    dev->wq = asyncmsg_wq;
+
+    dev->stats = alloc_percpu(struct asyncmsg_pcpu_stats);
+    err = dev->stats ? asyncmsg_dlq_init(dev) : -ENOMEM;
+    if(!err)
+        err = asyncmsg_persist_init(dev);
+    if(err)
     {
-        printk(KERN_ERR "asyncmsg: failed to allocate device number\n");
-        return err;
-    } 
-    asyncmsg_dev.max_queue_size = MAX_QUEUE_SIZE;
-    asyncmsg_dev.queue = kmalloc_array(asyncmsg_dev.max_queue_size, sizeof(struct async_msg *), GFP_KERNEL);
-    if (!asyncmsg_dev.queue) {
-        printk(KERN_ERR "asyncmsg: failed to allocate queue\n");
-        return -ENOMEM;
+        printk(KERN_ERR "asyncmsg%d: failed to set up persistence\n", index);
+        kfree(dev->dlq.ents);
+        free_percpu(dev->stats);
+        timer_delete_sync(&dev->stat_timer);
+        percpu_free_rwsem(&dev->resize_sem);
+        asyncmsg_lanes_free(dev);
+        kfree(dev);
+        return ERR_PTR(err);
     }
-    memset(asyncmsg_dev.queue, 0, asyncmsg_dev.max_queue_size * sizeof(struct async_msg *));
 
-    asyncmsg_dev.asyncmsg_cache = kmem_cache_create("asyncmsg_cache", sizeof(struct async_msg), 0,
-                                    SLAB_HWCACHE_ALIGN, asyncmsg_contructor);
-    
-    if(!asyncmsg_dev.asyncmsg_cache)
+    cdev_init(&dev->cdev, &asyncmsg_fops);
+    dev->cdev.owner = THIS_MODULE;
+    err = cdev_add(&dev->cdev, devno, 1);
+    if(err)
     {
-        printk(KERN_ERR "asyncmsg: failed to create slab cache\n");
-        return -ENOMEM;
+        printk(KERN_ERR "asyncmsg%d: failed to add cdev\n", index);
+        asyncmsg_free_queue(dev);
+        return ERR_PTR(err);
     }
 
-    asyncmsg_dev.asyncmsg_mempool = mempool_create(MIN_POOL_OBJECTS, mempool_alloc_slab, 
-                                            mempool_free_slab, asyncmsg_dev.asyncmsg_cache);
-    if(!asyncmsg_dev.asyncmsg_mempool)
+    device = device_create(asyncmsg_class, NULL, devno, NULL, "asyncmsg%d", index);
+    if(IS_ERR(device))
     {
-        printk(KERN_ERR "asyncmsg: failed tp create mempool\n");
-        return -ENOMEM;
+        cdev_del(&dev->cdev);
+        asyncmsg_free_queue(dev);
+        return ERR_CAST(device);
     }
 
-    // initializing device struct
-    asyncmsg_dev.head = 0;
-    asyncmsg_dev.tail = 0;
-    asyncmsg_dev.free_messages = 0;
-    asyncmsg_dev.open_count = 0;
-    asyncmsg_dev.last_jiffies = 0;
+    return dev;
+}
 
-    sema_init(&asyncmsg_dev.sem, 1);
-    spin_lock_init(&asyncmsg_dev.lock);
-    init_waitqueue_head (&asyncmsg_dev.read_q);
-    init_waitqueue_head(&asyncmsg_dev.write_q);
+static void asyncmsg_destroy_queue(struct asyncmsg_dev *dev)
+{
+    device_destroy(asyncmsg_class, MKDEV(asyncmsg_major, dev->index));
+    cdev_del(&dev->cdev);
+    asyncmsg_free_queue(dev);
+}
 
-    timer_setup(&asyncmsg_dev.stat_timer, asyncmsg_timer_fn, 0);
-    mod_timer(&asyncmsg_dev.stat_timer, jiffies + msecs_to_jiffies(600000));
+/* ASYNC_MSG_CREATE_QUEUE and module load: returns the index of the new queue */
+static int asyncmsg_add_queue(void)
+{
+    struct asyncmsg_dev *dev;
+    int index;
 
-    tasklet_init(&asyncmsg_dev.msg_tasklet, asyncmsg_tasklet_fn, (unsigned long)&asyncmsg_dev);
-    asyncmsg_dev.wq = create_singlethread_workqueue("asyncmsg_wq");
-    if(!asyncmsg_dev.wq)
+    mutex_lock(&asyncmsg_devs_lock);
+    if (asyncmsg_nr_devs >= ASYNCMSG_MAX_QUEUES)
     {
-        err = -ENOMEM;
-        goto fail_wq;
+        mutex_unlock(&asyncmsg_devs_lock);
+        return -ENOSPC;
+    }
+    index = asyncmsg_nr_devs;
+    dev = asyncmsg_create_queue(index);
+    if (IS_ERR(dev))
+    {
+        mutex_unlock(&asyncmsg_devs_lock);
+        return PTR_ERR(dev);
     }
-    // INIT_DELAYED_WORK(&asyncmsg_dev.heavy_job, asyncmsg_work_fn);
+    asyncmsg_devs[index] = dev;
+    asyncmsg_nr_devs++;
+    mutex_unlock(&asyncmsg_devs_lock);
 
-    cdev_init(&asyncmsg_dev.cdev, &asyncmsg_fops);
-    asyncmsg_dev.cdev.owner = THIS_MODULE;
-    err = cdev_add(&asyncmsg_dev.cdev, asyncmsg_devno, 1);
-    if(err)
+    return index;
+}
+
+static int __init asyncmsg_init(void)
+{
+    int err;
+
+    if (nr_queues < 1 || nr_queues > ASYNCMSG_MAX_QUEUES)
+    {
+        printk(KERN_ERR "asyncmsg: nr_queues must be 1..%d\n", ASYNCMSG_MAX_QUEUES);
+        return -EINVAL;
+    }
+
+    err = alloc_chrdev_region(&asyncmsg_devno, 0, ASYNCMSG_MAX_QUEUES, "asyncmsg");
+    asyncmsg_major = MAJOR(asyncmsg_devno);
+    if(err < 0)
+    {
+        printk(KERN_ERR "asyncmsg: failed to allocate device number\n");
+        return err;
+    } 
+
+    /* one shared workqueue, every queue has its own heavy_job on it */
+    asyncmsg_wq = alloc_workqueue("asyncmsg_wq", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+    if(!asyncmsg_wq)
     {
-        printk(KERN_ERR "asyncmsg: failed to add cdev\n");
-        goto fail_cdev;
+        err = -ENOMEM;
+        goto fail_wq;
     }
 
     asyncmsg_class = class_create("asyncmsg");
@@ -498,38 +4970,48 @@ static int __init asyncmsg_init(void)
         goto fail_class;
     }
 
-    device_create(asyncmsg_class, NULL, asyncmsg_devno, NULL, "asyncmsg");
+    err = asyncmsg_caches_create();
+    if(err)
+    {
+        printk(KERN_ERR "asyncmsg: failed to create payload caches\n");
+        goto fail_caches;
+    }
+
+    for (int i = 0; i < nr_queues; i++)
+    {
+        err = asyncmsg_add_queue();
+        if (err < 0)
+        {
+            goto fail_queues;
+        }
+    }
 
-    printk(KERN_INFO "asyncmsg: module loaded with major\n");
+    printk(KERN_INFO "asyncmsg: module loaded with major %d, %d queues\n", asyncmsg_major, nr_queues);
 
     return 0;
 
+fail_queues:
+    while (asyncmsg_nr_devs > 0)
+        asyncmsg_destroy_queue(asyncmsg_devs[--asyncmsg_nr_devs]);
+    asyncmsg_caches_destroy();
+fail_caches:
+    class_destroy(asyncmsg_class);
 fail_class:
-    cdev_del(&asyncmsg_dev.cdev);
-fail_cdev:
-    destroy_workqueue(asyncmsg_dev.wq);
+    destroy_workqueue(asyncmsg_wq);
 fail_wq:
-    unregister_chrdev_region(asyncmsg_devno, 1);
+    unregister_chrdev_region(asyncmsg_devno, ASYNCMSG_MAX_QUEUES);
     return err;
 }   
 
 
 static void __exit asyncmsg_exit(void)
 {
-    for (int i = 0; i < asyncmsg_dev.tail; i++) {
-        if (asyncmsg_dev.queue[i]) {
-            mempool_free(asyncmsg_dev.queue[i], asyncmsg_dev.asyncmsg_mempool);
-            asyncmsg_dev.queue[i] = NULL;
-        }
-    }
-    kfree(asyncmsg_dev.queue);
-    device_destroy(asyncmsg_class, asyncmsg_devno);
+    while (asyncmsg_nr_devs > 0)
+        asyncmsg_destroy_queue(asyncmsg_devs[--asyncmsg_nr_devs]);
+    asyncmsg_caches_destroy();
     class_destroy(asyncmsg_class);
-    cdev_del(&asyncmsg_dev.cdev);
-    timer_delete_sync(&asyncmsg_dev.stat_timer);
-    mempool_destroy(asyncmsg_dev.asyncmsg_mempool);
-    kmem_cache_destroy(asyncmsg_dev.asyncmsg_cache);
-    unregister_chrdev_region(asyncmsg_devno, 1);
+    destroy_workqueue(asyncmsg_wq);
+    unregister_chrdev_region(asyncmsg_devno, ASYNCMSG_MAX_QUEUES);
     printk(KERN_INFO "asyncmsg: module unloaded\n");
 }
 
@@ -6,72 +6,458 @@
 #include <linux/uaccess.h>
 #include <linux/device.h>
 #include <linux/time.h>
-#include <linux/interrupt.h>
+#include <linux/workqueue.h>
+#include <linux/unaligned.h>
 #include <linux/types.h> 
 #include <linux/wait.h>
 #include <linux/ratelimit.h>
-#include <linux/mempool.h>
 #include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/crc32.h>
+#include <linux/atomic.h>
+#include <linux/percpu.h>
+#include <linux/percpu-rwsem.h>
 #include <linux/jiffies.h>
 #include <linux/poll.h>
 #include <linux/timer.h>
+#include <linux/mutex.h>
+#include <linux/vmalloc.h>
+#include <linux/hrtimer.h>
+#include <linux/eventfd.h>
+#include <linux/rculist.h>
+#include <linux/io_uring/cmd.h>
+#include <linux/math64.h>
+#include <linux/hashtable.h>
+#include <linux/rhashtable.h>
 
+#include "asyncmsg_uapi.h"
 
-#define MAX_MSG_LEN 128
+
+// payload bytes per message; up to MSG_INLINE_LEN they live in the slot itself
+#define MAX_MSG_LEN ASYNC_MSG_MAX_LEN
+#define MSG_INLINE_LEN 80
+// out-of-line payloads come from size-class caches of these sizes
+#define ASYNCMSG_NR_CLASSES 4
+#define ASYNCMSG_CLASS_SIZES { 256, 1024, 4096, MAX_MSG_LEN }
 #define MAX_QUEUE_SIZE 4
 #define RETURN_MESSAGE 512
+// binary reads are staged in a buffer that holds at least one full record
+#define ASYNCMSG_BOUNCE_SIZE \
+    max_t(size_t, PAGE_SIZE, ASYNC_MSG_REC_SIZE(sizeof(struct asyncmsg_classes) + MAX_MSG_LEN))
+// most bytes a framed write parses per call, the rest is a short write
+#define MAX_WRITE_BATCH (64 * 1024)
+
+// minors reserved up front, queues beyond nr_queues come from ASYNC_MSG_CREATE_QUEUE
+#define ASYNCMSG_MAX_QUEUES 64
+#define ASYNCMSG_PATH_LEN 48
+
+// max value accepted by ASYNC_MSG_SET_SIZE
+#define MAX_QUEUE_LIMIT 4096
+
+/* dead letters kept in memory per queue, power of two */
+#define ASYNCMSG_DLQ_SIZE 256
+#define ASYNCMSG_DLQ_SPILL_BUF (64 * 1024)
+#define ASYNCMSG_DLQ_LINE 512
+/* payload bytes a spilled line carries, hex encoded */
+#define ASYNCMSG_DLQ_HEX 160
 
-// ioctl
-#define ASYNC_MSG_IOC_MAGIC 't'
-#define ASYNC_MSG_CLEAR_IO _IO(ASYNC_MSG_IOC_MAGIC, 0)
-#define ASYNC_MSG_SET_SIZE _IOW(ASYNC_MSG_IOC_MAGIC, 1, int)
-#define ASYNC_MSG_GET_SIZE _IOR(ASYNC_MSG_IOC_MAGIC, 2, int)
-#define ASYNC_MSG_GET_STAT _IOR(ASYNC_MSG_IOC_MAGIC, 3, int)
-#define ASYNC_MSG_IOC_MXMR 3
+/* stat_timer: the stats line, and the TTL sweep unless ASYNC_MSG_SET_TTL says otherwise */
+#define ASYNCMSG_STAT_MS 600000
+#define ASYNCMSG_SWEEP_MS 1000
+#define ASYNCMSG_SWEEP_MIN_MS 10
 
-// mempool
-#define MIN_POOL_OBJECTS 4
+/* a filtered reader is ready after this many messages without a match, to drop them */
+#define ASYNCMSG_FILTER_SCAN 64
+/* payload a readiness check searches with interrupts off before it gives up and says ready */
+#define ASYNCMSG_FILTER_SCAN_BYTES 4096
 
+/* the classify stage holds sem for a chunk at a time and requeues itself after a pass */
+#define ASYNCMSG_CLS_CHUNK 16
+#define ASYNCMSG_CLS_BATCH 256
 
+// persistence: producers only fill their CPU's staging buffer, heavy_job writes it out
+#define PERSIST_STAGE_SIZE (64 * 1024)
+#define PERSIST_FLUSH_BYTES (16 * 1024)
+#define PERSIST_FLUSH_MS 50
+#define PERSIST_MARKS 64
+/* replay sorts and dedups its backlog whenever it holds this many records */
+#define PERSIST_BACKLOG_MAX (2 * ASYNC_MSG_PRIO_LEVELS * MAX_QUEUE_LIMIT)
+
+// binary log
+#define ASYNCMSG_LOG_MAGIC 0x474d5341   /* "ASMG" */
+#define ASYNCMSG_LOG_MAGIC_KEYED 0x4b4d5341   /* "ASMK", the same for a keyed message */
+#define ASYNCMSG_CKPT_MAGIC_V1 0x504b4341  /* "ACKP" */
+#define ASYNCMSG_CKPT_MAGIC 0x4c4b4341  /* "ACKL", with per-lane seqs */
+
+
+/*
+ * One ring slot, the payload lives inline so dequeue never chases a pointer.
+ * ready is the low half of pos + 1 once the producer that reserved pos has
+ * filled the slot; readers must not look at anything else before that.
+ */
 struct async_msg
 {
-    char msg[MAX_MSG_LEN];
+    u32 ready;
+    /* one byte, so only written under sem or before the slot is published */
+    bool processed:1;
+    bool classified:1;  /* cls is valid, set by the classify stage or a reader */
+    bool redelivered:1;
+    bool expired:1;     /* past ttl_ms and already accounted for */
+    bool keyed:1;       /* ASYNC_MSG_REC_KEY, the key is the start of the payload */
+    u32 len;
+    u32 ttl_ms;         /* 0: never expires */
+    u64 timestamp_ns;
+    u64 seq;
+    char *ext;      /* payload from a size-class cache, NULL when it is inline */
+    struct asyncmsg_classes cls;
+    char inline_msg[MSG_INLINE_LEN];
+} ____cacheline_aligned_in_smp;
+
+static inline char *asyncmsg_data(struct async_msg *msg)
+{
+    return msg->ext ? msg->ext : msg->inline_msg;
+}
+
+/*
+ * On-disk log record, followed by len payload bytes. crc covers the header
+ * (with crc zeroed) and the payload, so a torn tail is detected on replay.
+ */
+struct asyncmsg_log_rec
+{
+    u32 magic;
+    u32 len;
+    u64 seq;
+    u64 timestamp_ns;
+    u32 crc;
+    u32 ttl_ms;     /* 0 in logs from before TTLs, which means none */
+};
+
+/*
+ * ASYNCMSG_LOG_MAGIC_KEYED record: gen sits between the header and the
+ * payload and is covered by crc. Compaction logs a message again under its
+ * seq, replay keeps the record with the highest gen.
+ */
+struct asyncmsg_log_rec_keyed
+{
+    struct asyncmsg_log_rec rec;
+    u64 gen;
+};
+
+/*
+ * A message's seq carries its lane in the top bits, so every lane counts in
+ * its own range and lane 0 keeps the seqs of logs written before lanes.
+ */
+#define ASYNCMSG_LANE_SHIFT 56
+#define ASYNCMSG_SEQ_LANE(seq) ((unsigned int)((seq) >> ASYNCMSG_LANE_SHIFT))
+
+/* everything before off / below seq[lane] has been consumed */
+struct asyncmsg_ckpt
+{
+    u32 magic;
+    u32 max_queue_size;
+    u64 seq[ASYNC_MSG_PRIO_LEVELS];
+    u64 off;
+    u32 crc;
+    u32 reserved;
+};
+
+/* checkpoint from before priority lanes, seq is lane 0 */
+struct asyncmsg_ckpt_v1
+{
+    u32 magic;
+    u32 max_queue_size;
+    u64 seq;
+    u64 off;
+    u32 crc;
+    u32 reserved;
+};
+
+/* per-CPU staging buffer, the lock is only contended while heavy_job swaps it out */
+struct asyncmsg_stage {
+    spinlock_t lock;
+    char *buf;
     size_t len;
+    u64 max_seq[ASYNC_MSG_PRIO_LEVELS];
+    unsigned int lanes;     /* bit per lane with a record in buf */
+};
+
+/* log region [off, next mark) holds no seq above max_seq of its lane, and none of lanes not set */
+struct asyncmsg_mark {
+    u64 off;
+    u64 max_seq[ASYNC_MSG_PRIO_LEVELS];
+    unsigned int lanes;
+};
+
+/*
+ * Group commit state. CPUs flush in whatever order heavy_job visits them, so
+ * the log is only roughly in seq order. The marks remember the highest seq
+ * per lane of every flushed chunk, which is enough to find the first offset
+ * that can still hold an unconsumed record for the checkpoint.
+ */
+struct asyncmsg_persist {
+    spinlock_t lock;
+    struct asyncmsg_stage __percpu *stages;
+    char *flush_buf;
+    u64 log_end;
+
+    struct asyncmsg_mark marks[PERSIST_MARKS];
+    int nr_marks;
+
+    /* ASYNC_MSG_SYNC generations: requested vs fsynced */
+    u64 sync_req;
+    u64 durable_gen;
+
+    u64 ckpt_seq[ASYNC_MSG_PRIO_LEVELS];
+    bool ckpt_dirty;
+
+    /* last gen given to a keyed record, continues from the log after a load */
+    atomic64_t key_gen;
+
+    struct file *log_file;
+    struct file *ckpt_file;
+    wait_queue_head_t flush_q;
+};
+
+/*
+ * Token bucket kept as GCRA: tat is the time at which the bucket is full
+ * again, so taking tokens is a single cmpxchg and needs no lock.
+ */
+struct asyncmsg_bucket {
+    atomic64_t tat;
+    u64 interval_ns;    /* ns per token, 0: unlimited */
+    u32 burst;
+    u32 rate;           /* as set, for stats */
+};
+
+/* payload comes from the size class caches so replay can hand it to a slot */
+struct asyncmsg_dlq_ent {
     u64 timestamp_ns;
-    bool processed;
+    u32 reason;
+    u32 len;
+    u32 prio;
+    char *data;
+};
+
+/*
+ * DLQ ring, free-running positions under lock: [head, tail) is kept for
+ * ASYNC_MSG_DLQ_READ/REPLAY, [spill, tail) is not on disk yet.
+ */
+struct asyncmsg_dlq {
+    spinlock_t lock;
+    struct asyncmsg_dlq_ent *ents;
+    u64 head;
+    u64 spill;
+    u64 tail;
+    u64 dropped;
+    struct work_struct spill_work;
+};
+
+/* this CPU's share of struct asyncmsg_stats, summed by ASYNC_MSG_GET_STATS */
+struct asyncmsg_pcpu_stats {
+    u64 enqueued;
+    u64 dequeued;
+    u64 enqueued_bytes;
+    u64 dequeued_bytes;
+    u64 dlq[ASYNC_MSG_DLQ_REASONS];
+    u64 rate_limited;
+    u64 wait_timeouts;
+    u64 lat_ns[ASYNC_MSG_LAT_BUCKETS];
+    u64 expired;
+    u64 compacted;
+    u64 filtered;
+};
+
+/* a message read in at-least-once mode, out of the ring until acked or expired */
+struct asyncmsg_lease {
+    struct list_head lane_node;     /* dev->leases[prio], in seq order */
+    struct list_head file_node;     /* owner's list, in deadline order */
+    struct hlist_node hnode;        /* owner's table, by seq */
+    u64 deadline_ns;
+    unsigned int prio;
+    struct async_msg msg;
+};
+
+#define ASYNCMSG_LEASE_HASH_BITS 8
+#define ASYNCMSG_LEASE_RETRY_MS 10   /* expired but the lane was full */
+
+/* ASYNC_MSG_SET_VISIBILITY state, kept from the first call until release */
+struct asyncmsg_leases {
+    struct asyncmsg_file *ctx;
+    u32 timeout_ms;
+    bool dying;
+    /* both under dev->lease_lock */
+    struct list_head list;
+    DECLARE_HASHTABLE(hash, ASYNCMSG_LEASE_HASH_BITS);
+    /* fires at the first deadline and hands the expired ones to work */
+    struct hrtimer timer;
+    struct work_struct work;
+};
+
+/* compaction index, a key is compacted per lane */
+struct asyncmsg_key_id {
+    u64 key;
+    u32 prio;
+    u32 pad;        /* 0, the whole struct is hashed */
+};
+
+struct asyncmsg_key_ent {
+    struct rhash_head node;
+    struct asyncmsg_key_id id;
+    u64 pos;        /* the newest queued message of the key in lane id.prio */
+    struct rcu_head rcu;
+};
+
+/* fan-out read position, shared by the files of a group */
+struct asyncmsg_cursor {
+    struct list_head node;      /* dev->cursors */
+    char group[ASYNC_MSG_GROUP_LEN];
+    unsigned int users;
+    /* next position to read per lane, never behind the lane head */
+    u64 pos[ASYNC_MSG_PRIO_LEVELS];
+    u64 delivered;
+};
+
+/* one priority lane, lanes[p] of the queue */
+struct asyncmsg_lane {
+    /* ring of ring_mask + 1 slots (power of two >= max_queue_size) */
+    struct async_msg *queue;
+    unsigned int ring_mask;
+    /*
+     * Free-running positions, slot index is pos & ring_mask. Producers
+     * reserve with a cmpxchg on tail, head only moves under sem.
+     */
+    atomic64_t head;
+    atomic64_t tail;
+    /* message seq is pos + seq_base, fixed after log replay */
+    u64 seq_base;
+    /* positions below replay_end hold replayed messages, replay_seq[pos] is their seq */
+    u64 *replay_seq;
+    u64 replay_end;
+    /* first slot the classify stage has not looked at, under sem */
+    u64 cls_pos;
 };
 
 struct asyncmsg_dev {
-    // struct async_msg queue[MAX_QUEUE_SIZE];
-    int max_queue_size;
-    struct async_msg **queue;
-    int head;
-    int tail;
-    int free_messages;
+    int index;
+    int max_queue_size;     /* per lane */
+    struct asyncmsg_lane lanes[ASYNC_MSG_PRIO_LEVELS];
+    /* producers hold it for read, resize and clear take it for write */
+    struct percpu_rw_semaphore resize_sem;
     int open_count;
     struct cdev cdev;
 
-    struct kmem_cache *asyncmsg_cache;
-    mempool_t *asyncmsg_mempool;
-
-    struct semaphore sem;
+    struct semaphore sem;      /* serializes consumers, resize and clear */
+    /* ASYNC_MSG_SET_FANOUT and the cursors, both under sem */
+    bool fanout;
+    struct list_head cursors;
+    /* outstanding leases per lane, the first one holds the checkpoint back */
+    spinlock_t lease_lock;
+    struct list_head leases[ASYNC_MSG_PRIO_LEVELS];
+    int lease_files;        /* files with ASYNC_MSG_SET_VISIBILITY, under sem */
+    int skip_filters;       /* files with a payload or key filter and no FILTER_DROP, under sem */
+    /* ASYNC_MSG_SET_TTL; ttl_used once any message had a TTL, the sweep runs from then on */
+    u32 ttl_ms;
+    u32 ttl_flags;
+    u32 sweep_ms;
+    bool ttl_used;
+    /*
+     * ASYNC_MSG_SET_COMPACT. keys is only there while compact is set; both
+     * change under key_lock and sem, entries under sem. key_lock also keeps
+     * keyed writers one at a time.
+     */
+    struct mutex key_lock;
+    bool compact;
+    struct rhashtable keys;
+    /* bumped under lock when compaction overwrites a queued payload, see filter_ready */
+    u32 filter_gen;
     spinlock_t lock;
     wait_queue_head_t read_q;
     wait_queue_head_t write_q;
 
+    /* sweeps every sweep_ms once TTLs are in use, prints every ASYNCMSG_STAT_MS */
     struct timer_list stat_timer;
-    struct tasklet_struct msg_tasklet;
+    unsigned long stat_next;
+    struct work_struct ttl_work;
+    struct work_struct cls_work;   /* classify stage */
     struct workqueue_struct *wq;
-    struct work_struct heavy_job;
+    struct delayed_work heavy_job;
+    struct asyncmsg_persist persist;
+    char log_path[ASYNCMSG_PATH_LEN];
+    char ckpt_path[ASYNCMSG_PATH_LEN];
+    char dlq_path[ASYNCMSG_PATH_LEN];
+    struct asyncmsg_dlq dlq;
 
-    struct fasync_struct *async_queue;
+    struct asyncmsg_bucket rate;
 
-    unsigned long last_jiffies;
-    unsigned int write_delay_ms;
+    struct asyncmsg_pcpu_stats __percpu *stats;
+    atomic64_t depth_hwm;
 
     struct fasync_struct *fasync_queue;
+    /* files with an eventfd, producers and consumers walk it under RCU */
+    struct list_head efd_list;
+    spinlock_t efd_lock;
+    /* parked io_uring commands, retried when messages arrive or slots free up */
+    struct list_head uring_rx;
+    struct list_head uring_tx;
+    spinlock_t uring_lock;
 };
 
+/*
+ * mmap tx: a record header as the driver checked it. The payload is copied
+ * straight from the shared ring into its slot, rec.seq holds the ring
+ * position right after the record.
+ */
+struct asyncmsg_frame {
+    struct asyncmsg_rec rec;
+    const char *data;
+    u64 key;
+};
 
+#define ASYNCMSG_TX_FRAMES (MAX_WRITE_BATCH / ASYNC_MSG_REC_SIZE(0))
 
-
+/* per open file state, file->private_data */
+struct asyncmsg_file {
+    struct asyncmsg_dev *dev;
+    int read_mode;
+    int write_mode;
+    struct asyncmsg_timeouts timeouts;
+    struct asyncmsg_watermarks wm;
+    struct asyncmsg_bucket rate;
+    /* ASYNC_MSG_SET_PRIO; the WEIGHTED round is only touched under sem */
+    struct asyncmsg_prio prio;
+    unsigned int rr_lane;
+    u32 rr_credit;
+    /* ASYNC_MSG_SET_FILTER, changes under sem and dev->lock */
+    struct asyncmsg_filter filter;
+    /*
+     * Readiness verdicts, under dev->lock: nothing in [read pos, filter_scan)
+     * of a lane matches, filter_hit - 1 does. Good while filter_gen is the
+     * device's.
+     */
+    u64 filter_scan[ASYNC_MSG_PRIO_LEVELS];
+    u64 filter_hit[ASYNC_MSG_PRIO_LEVELS];
+    u32 filter_gen;
+    /* fan-out mode only, set once under sem and kept until release */
+    struct asyncmsg_cursor *cursor;
+    struct asyncmsg_leases *leases;
+    /* fires rx_max_delay_us after a reader saw messages below rx_lowat */
+    struct hrtimer rx_timer;
+    bool rx_expired;
+    /* ASYNC_MSG_SET_EVENTFD, on dev->efd_list while efd is set */
+    struct eventfd_ctx __rcu *efd;
+    u32 efd_events;
+    struct list_head efd_node;
+    /* binary reads are assembled here so a batch costs one copy_to_user */
+    char *bounce;
+    /*
+     * mmap()ed rings, ring_lock makes the driver a single tx consumer and rx
+     * producer. It also serializes ASYNC_MSG_SET_EVENTFD.
+     */
+    struct mutex ring_lock;
+    void *ring_mem;
+    struct asyncmsg_ring_ctl *ring_ctl;
+    u32 ring_size;
+    u32 tx_head;        /* driver copies, never read back from the shared page */
+    u32 rx_tail;
+    struct asyncmsg_frame *tx_frames;
+};
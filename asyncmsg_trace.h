@@ -0,0 +1,169 @@
+/*
+ * Tracepoints of the hot paths, /sys/kernel/tracing/events/asyncmsg/.
+ * Nothing is formatted unless an event is enabled.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM asyncmsg
+
+#if !defined(_ASYNCMSG_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ASYNCMSG_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#define ASYNCMSG_WAKE_RX 0
+#define ASYNCMSG_WAKE_TX 1
+
+/* a batch of k messages published at seq .. seq + k - 1 */
+TRACE_EVENT(asyncmsg_enqueue,
+    TP_PROTO(int index, u64 seq, unsigned int n, u64 bytes, u64 depth),
+    TP_ARGS(index, seq, n, bytes, depth),
+    TP_STRUCT__entry(
+        __field(int, index)
+        __field(u64, seq)
+        __field(unsigned int, n)
+        __field(u64, bytes)
+        __field(u64, depth)
+    ),
+    TP_fast_assign(
+        __entry->index = index;
+        __entry->seq = seq;
+        __entry->n = n;
+        __entry->bytes = bytes;
+        __entry->depth = depth;
+    ),
+    TP_printk("asyncmsg%d seq=%llu n=%u bytes=%llu depth=%llu",
+              __entry->index, __entry->seq, __entry->n, __entry->bytes, __entry->depth)
+);
+
+/* slots [head, new_head) consumed, lat_ns is how long the oldest one waited */
+TRACE_EVENT(asyncmsg_dequeue,
+    TP_PROTO(int index, u64 head, u64 new_head, u64 lat_ns),
+    TP_ARGS(index, head, new_head, lat_ns),
+    TP_STRUCT__entry(
+        __field(int, index)
+        __field(u64, head)
+        __field(u64, new_head)
+        __field(u64, lat_ns)
+    ),
+    TP_fast_assign(
+        __entry->index = index;
+        __entry->head = head;
+        __entry->new_head = new_head;
+        __entry->lat_ns = lat_ns;
+    ),
+    TP_printk("asyncmsg%d head=%llu n=%llu lat_ns=%llu",
+              __entry->index, __entry->head, __entry->new_head - __entry->head, __entry->lat_ns)
+);
+
+TRACE_EVENT(asyncmsg_dlq_reject,
+    TP_PROTO(int index, u32 reason, unsigned int n),
+    TP_ARGS(index, reason, n),
+    TP_STRUCT__entry(
+        __field(int, index)
+        __field(u32, reason)
+        __field(unsigned int, n)
+    ),
+    TP_fast_assign(
+        __entry->index = index;
+        __entry->reason = reason;
+        __entry->n = n;
+    ),
+    TP_printk("asyncmsg%d reason=%s n=%u", __entry->index,
+              __print_symbolic(__entry->reason,
+                               { ASYNC_MSG_DLQ_QUEUE_FULL, "queue_full" },
+                               { ASYNC_MSG_DLQ_WAIT_TIMEOUT, "wait_timeout" },
+                               { ASYNC_MSG_DLQ_LEASE_LOST, "lease_lost" },
+                               { ASYNC_MSG_DLQ_EXPIRED, "expired" }),
+              __entry->n)
+);
+
+/* readers (rx) or writers (tx) woken, nr is the most that may wake, 0 all of them */
+TRACE_EVENT(asyncmsg_wakeup,
+    TP_PROTO(int index, int dir, unsigned int nr),
+    TP_ARGS(index, dir, nr),
+    TP_STRUCT__entry(
+        __field(int, index)
+        __field(int, dir)
+        __field(unsigned int, nr)
+    ),
+    TP_fast_assign(
+        __entry->index = index;
+        __entry->dir = dir;
+        __entry->nr = nr;
+    ),
+    TP_printk("asyncmsg%d %s nr=%u", __entry->index,
+              __print_symbolic(__entry->dir,
+                               { ASYNCMSG_WAKE_RX, "rx" },
+                               { ASYNCMSG_WAKE_TX, "tx" }),
+              __entry->nr)
+);
+
+/* one heavy_job pass: staged bytes written to the log, fsync or not */
+TRACE_EVENT(asyncmsg_persist_flush,
+    TP_PROTO(int index, u64 bytes, u64 log_end, bool sync, bool ckpt),
+    TP_ARGS(index, bytes, log_end, sync, ckpt),
+    TP_STRUCT__entry(
+        __field(int, index)
+        __field(u64, bytes)
+        __field(u64, log_end)
+        __field(bool, sync)
+        __field(bool, ckpt)
+    ),
+    TP_fast_assign(
+        __entry->index = index;
+        __entry->bytes = bytes;
+        __entry->log_end = log_end;
+        __entry->sync = sync;
+        __entry->ckpt = ckpt;
+    ),
+    TP_printk("asyncmsg%d bytes=%llu log_end=%llu sync=%d ckpt=%d", __entry->index,
+              __entry->bytes, __entry->log_end, __entry->sync, __entry->ckpt)
+);
+
+/* only emitted when a bucket cut the batch short */
+TRACE_EVENT(asyncmsg_rate_limit,
+    TP_PROTO(int index, unsigned int requested, unsigned int file_ok, unsigned int allowed),
+    TP_ARGS(index, requested, file_ok, allowed),
+    TP_STRUCT__entry(
+        __field(int, index)
+        __field(unsigned int, requested)
+        __field(unsigned int, file_ok)
+        __field(unsigned int, allowed)
+    ),
+    TP_fast_assign(
+        __entry->index = index;
+        __entry->requested = requested;
+        __entry->file_ok = file_ok;
+        __entry->allowed = allowed;
+    ),
+    TP_printk("asyncmsg%d requested=%u file=%u allowed=%u", __entry->index,
+              __entry->requested, __entry->file_ok, __entry->allowed)
+);
+
+/* one pass of the classify stage over n messages from seq */
+TRACE_EVENT(asyncmsg_process,
+    TP_PROTO(int index, u64 seq, unsigned int n, u64 bytes),
+    TP_ARGS(index, seq, n, bytes),
+    TP_STRUCT__entry(
+        __field(int, index)
+        __field(u64, seq)
+        __field(unsigned int, n)
+        __field(u64, bytes)
+    ),
+    TP_fast_assign(
+        __entry->index = index;
+        __entry->seq = seq;
+        __entry->n = n;
+        __entry->bytes = bytes;
+    ),
+    TP_printk("asyncmsg%d seq=%llu n=%u bytes=%llu", __entry->index,
+              __entry->seq, __entry->n, __entry->bytes)
+);
+
+#endif /* _ASYNCMSG_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE asyncmsg_trace
+#include <trace/define_trace.h>
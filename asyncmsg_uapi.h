@@ -0,0 +1,429 @@
+/*
+ * Userspace ABI of /dev/asyncmsg<N>: ioctl numbers and the binary record
+ * format. Included by the driver and by the programs in test/.
+ */
+#ifndef ASYNCMSG_UAPI_H
+#define ASYNCMSG_UAPI_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+// ioctl
+#define ASYNC_MSG_IOC_MAGIC 't'
+#define ASYNC_MSG_CLEAR_IO _IO(ASYNC_MSG_IOC_MAGIC, 0)
+#define ASYNC_MSG_SET_SIZE _IOW(ASYNC_MSG_IOC_MAGIC, 1, int)
+#define ASYNC_MSG_GET_SIZE _IOR(ASYNC_MSG_IOC_MAGIC, 2, int)
+/* text line into a 512 byte buffer, see ASYNC_MSG_GET_STATS for the binary form */
+#define ASYNC_MSG_GET_STAT _IOR(ASYNC_MSG_IOC_MAGIC, 3, int)
+#define ASYNC_MSG_SYNC _IO(ASYNC_MSG_IOC_MAGIC, 4)
+#define ASYNC_MSG_CREATE_QUEUE _IOR(ASYNC_MSG_IOC_MAGIC, 5, int)
+#define ASYNC_MSG_SET_READ_MODE _IOW(ASYNC_MSG_IOC_MAGIC, 6, int)
+#define ASYNC_MSG_SET_INTERVAL _IOW(ASYNC_MSG_IOC_MAGIC, 7, int)
+#define ASYNC_MSG_SET_WRITE_MODE _IOW(ASYNC_MSG_IOC_MAGIC, 8, int)
+#define ASYNC_MSG_RING_KICK _IOW(ASYNC_MSG_IOC_MAGIC, 9, int)
+#define ASYNC_MSG_SET_TIMEOUTS _IOW(ASYNC_MSG_IOC_MAGIC, 10, struct asyncmsg_timeouts)
+#define ASYNC_MSG_SET_WATERMARKS _IOW(ASYNC_MSG_IOC_MAGIC, 11, struct asyncmsg_watermarks)
+#define ASYNC_MSG_SET_EVENTFD _IOW(ASYNC_MSG_IOC_MAGIC, 12, struct asyncmsg_eventfd)
+#define ASYNC_MSG_SET_RATE _IOW(ASYNC_MSG_IOC_MAGIC, 13, struct asyncmsg_rate)
+#define ASYNC_MSG_DLQ_READ _IOWR(ASYNC_MSG_IOC_MAGIC, 14, struct asyncmsg_dlq_read)
+#define ASYNC_MSG_DLQ_REPLAY _IOW(ASYNC_MSG_IOC_MAGIC, 15, int)
+#define ASYNC_MSG_GET_STATS _IOWR(ASYNC_MSG_IOC_MAGIC, 16, struct asyncmsg_stats)
+#define ASYNC_MSG_SET_PRIO _IOW(ASYNC_MSG_IOC_MAGIC, 17, struct asyncmsg_prio)
+#define ASYNC_MSG_SET_FANOUT _IOW(ASYNC_MSG_IOC_MAGIC, 18, int)
+#define ASYNC_MSG_SUBSCRIBE _IOW(ASYNC_MSG_IOC_MAGIC, 19, struct asyncmsg_subscribe)
+#define ASYNC_MSG_GET_CURSORS _IOWR(ASYNC_MSG_IOC_MAGIC, 20, struct asyncmsg_cursor_list)
+#define ASYNC_MSG_SET_VISIBILITY _IOW(ASYNC_MSG_IOC_MAGIC, 21, struct asyncmsg_visibility)
+#define ASYNC_MSG_ACK _IOW(ASYNC_MSG_IOC_MAGIC, 22, struct asyncmsg_ack)
+#define ASYNC_MSG_SET_TTL _IOW(ASYNC_MSG_IOC_MAGIC, 23, struct asyncmsg_ttl)
+#define ASYNC_MSG_SET_COMPACT _IOW(ASYNC_MSG_IOC_MAGIC, 24, int)
+#define ASYNC_MSG_LOOKUP _IOWR(ASYNC_MSG_IOC_MAGIC, 25, struct asyncmsg_lookup)
+#define ASYNC_MSG_SET_FILTER _IOW(ASYNC_MSG_IOC_MAGIC, 26, struct asyncmsg_filter)
+#define ASYNC_MSG_IOC_MXMR 26
+
+// ASYNC_MSG_SET_READ_MODE, per open file
+#define ASYNC_MSG_READ_TEXT 0     /* one formatted message per read() */
+#define ASYNC_MSG_READ_BINARY 1   /* as many struct asyncmsg_rec as fit */
+#define ASYNC_MSG_READ_BINARY_CLASSES 2   /* binary, with struct asyncmsg_classes per record */
+
+// ASYNC_MSG_SET_WRITE_MODE, per open file
+#define ASYNC_MSG_WRITE_RAW 0     /* the whole write()/writev() is one message */
+#define ASYNC_MSG_WRITE_FRAMED 1  /* a sequence of struct asyncmsg_rec, only len is used */
+
+/*
+ * Binary record: header followed by len payload bytes, padded so the next
+ * header starts on an ASYNC_MSG_REC_ALIGN boundary. A read never splits a
+ * record. Framed writes use the same layout, the padding of the last record
+ * may be left out.
+ */
+struct asyncmsg_rec {
+    __u32 len;
+    __u32 flags;
+    __u64 seq;
+    __u64 timestamp_ns;
+};
+
+/*
+ * ASYNC_MSG_SET_TIMEOUTS, per open file. A read that times out fails with
+ * EAGAIN, a write that times out goes to the DLQ and fails with ETIMEDOUT.
+ * O_NONBLOCK files never wait.
+ */
+struct asyncmsg_timeouts {
+    __u32 read_ms;        /* 0: wait until a message arrives */
+    __u32 write_ms;       /* 0: wait until there is room */
+    __u32 busy_poll_us;   /* readers spin this long before sleeping, 0: off */
+    __u32 reserved;       /* must be 0 */
+};
+
+#define ASYNC_MSG_TIMEOUT_DEFAULT_MS 15000
+#define ASYNC_MSG_BUSY_POLL_MAX_US 100000
+
+/*
+ * ASYNC_MSG_SET_WATERMARKS, per open file, like SO_RCVLOWAT/SO_SNDLOWAT but
+ * in messages. A blocking reader sleeps, and poll() holds back POLLIN, until
+ * rx_lowat messages are queued or rx_max_delay_us has passed since the
+ * first of them was seen. O_NONBLOCK reads take whatever is there.
+ */
+struct asyncmsg_watermarks {
+    __u32 rx_lowat;          /* 0 or 1: any message */
+    __u32 rx_max_delay_us;   /* 0: only rx_lowat counts */
+    __u32 tx_lowat;          /* free slots before POLLOUT, 0 or 1: any */
+    __u32 reserved;          /* must be 0 */
+};
+
+/*
+ * ASYNC_MSG_SET_EVENTFD, per open file. The eventfd is signaled once per
+ * batch of messages that makes the file readable (rx watermarks apply) and
+ * once per batch of freed slots that makes it writable. fd = -1 drops it.
+ */
+struct asyncmsg_eventfd {
+    __s32 fd;
+    __u32 events;
+};
+
+#define ASYNC_MSG_EV_IN 1         /* messages to read */
+#define ASYNC_MSG_EV_OUT 2        /* room to write */
+
+/*
+ * ASYNC_MSG_SET_RATE: token bucket for the whole queue or for this open
+ * file, a write has to pass both. Messages over the limit fail with EAGAIN
+ * (a framed batch may be cut short) and stay with the writer.
+ * ASYNC_MSG_SET_INTERVAL n is the queue bucket with one message every n ms,
+ * burst 1; stats show its rate rounded up.
+ */
+struct asyncmsg_rate {
+    __u32 rate;     /* messages per second, 0: unlimited */
+    __u32 burst;    /* messages that may go back to back, 0 counts as 1 */
+    __u32 scope;
+    __u32 reserved; /* must be 0 */
+};
+
+#define ASYNC_MSG_RATE_QUEUE 0
+#define ASYNC_MSG_RATE_FILE 1
+
+/*
+ * Priority lanes. Every queue has ASYNC_MSG_PRIO_LEVELS rings of
+ * ASYNC_MSG_SET_SIZE slots each, a higher prio is read first. A message
+ * goes to the file's prio unless its framed record sets
+ * ASYNC_MSG_REC_PRIO_SET; a framed write stops at the first record whose
+ * prio differs from the one before it (a short write, like any other).
+ * Binary reads report the lane in the record flags, and seqs of lane p
+ * count from p << 56. poll() adds POLLPRI while a lane above 0 has a
+ * message.
+ */
+#define ASYNC_MSG_PRIO_LEVELS 4
+
+/*
+ * ASYNC_MSG_SET_PRIO, per open file. STRICT always reads the highest lane
+ * that has a message. WEIGHTED reads up to weight[p] messages from lane p
+ * before it moves one lane down, wrapping to the top, so bulk lanes are
+ * never starved.
+ */
+struct asyncmsg_prio {
+    __u32 prio;         /* lane for this file's writes */
+    __u32 policy;
+    __u32 weight[ASYNC_MSG_PRIO_LEVELS];   /* WEIGHTED only, 0 counts as 1 */
+};
+
+#define ASYNC_MSG_PRIO_STRICT 0
+#define ASYNC_MSG_PRIO_WEIGHTED 1
+
+/*
+ * Fan-out. ASYNC_MSG_SET_FANOUT 1 makes reads non-destructive for the whole
+ * queue: every reader follows a cursor of its own, and a slot is reclaimed
+ * once the slowest cursor has passed it. A file gets a private cursor on
+ * its first read, or joins a named group with ASYNC_MSG_SUBSCRIBE before
+ * that; the files of a group share one cursor and split its messages
+ * between them. A cursor starts at the oldest queued message and is gone
+ * with the last file that uses it. Switching back to 0 fails with EBUSY
+ * while any cursor is left.
+ */
+#define ASYNC_MSG_GROUP_LEN 32
+
+struct asyncmsg_subscribe {
+    char group[ASYNC_MSG_GROUP_LEN];    /* NUL-terminated, "" for a private cursor */
+    __u32 flags;
+    __u32 reserved;
+};
+
+#define ASYNC_MSG_SUB_LATEST 1      /* a new cursor starts after the queued messages */
+
+/*
+ * ASYNC_MSG_GET_CURSORS fills addr with up to len bytes of
+ * struct asyncmsg_cursor_stat and returns the number of cursors, which can
+ * be more than count.
+ */
+struct asyncmsg_cursor_list {
+    __u64 addr;
+    __u32 len;
+    __u32 count;    /* out: entries written */
+};
+
+struct asyncmsg_cursor_stat {
+    char group[ASYNC_MSG_GROUP_LEN];
+    __u32 users;
+    __u32 reserved;
+    __u64 delivered;
+    __u64 lag;                          /* queued messages it has not read */
+    __u64 lane_lag[ASYNC_MSG_PRIO_LEVELS];
+};
+
+/*
+ * At-least-once reads. With timeout_ms set, what this file reads is leased
+ * instead of consumed: it leaves the queue, and unless its seq is passed to
+ * ASYNC_MSG_ACK within timeout_ms it goes back to the tail of its lane with
+ * a new seq and ASYNC_MSG_REC_REDELIVERED. Closing the file returns its
+ * unacked messages at once (to the DLQ when the lane is full). The
+ * checkpoint stops at the oldest unacked message, so a reload replays it
+ * too. Not available in fan-out mode.
+ */
+struct asyncmsg_visibility {
+    __u32 timeout_ms;   /* 0: reads consume again, leases already taken still run */
+    __u32 reserved;
+};
+
+/* ASYNC_MSG_ACK releases leases by seq and returns how many it found */
+struct asyncmsg_ack {
+    __u64 addr;     /* __u64 seq[count] */
+    __u32 count;
+    __u32 reserved;
+};
+
+/*
+ * Message TTL. A message expires ttl_ms after it was queued: readers skip
+ * it and it is counted in expired, or also goes to the DLQ with
+ * ASYNC_MSG_TTL_DLQ. The TTL is the queue's at the time of the write
+ * unless a framed record sets ASYNC_MSG_REC_TTL. Expired messages at the
+ * front of a lane are freed every sweep_ms even when nobody reads.
+ */
+struct asyncmsg_ttl {
+    __u32 ttl_ms;       /* 0: messages written from now on do not expire */
+    __u32 sweep_ms;     /* 0: the default of 1000 */
+    __u32 flags;        /* ASYNC_MSG_TTL_* */
+    __u32 reserved;     /* must be 0 */
+};
+
+#define ASYNC_MSG_TTL_DLQ 1
+
+/*
+ * Keyed messages. A framed record with ASYNC_MSG_REC_KEY starts its payload
+ * with a __u64 key (ASYNC_MSG_KEY_SIZE bytes, native byte order) and is
+ * read back with the flag and the key still in place. With
+ * ASYNC_MSG_SET_COMPACT 1 the queue keeps only the last value per key and
+ * lane: a keyed write whose key is still queued and unread overwrites that
+ * message in place, seq and position included, instead of taking a slot.
+ * In fan-out mode a message some cursor already read is not overwritten,
+ * the new value is queued behind it. Messages queued before compaction was
+ * turned on are indexed but not merged with each other.
+ *
+ * ASYNC_MSG_LOOKUP returns the queued value of key from the highest lane
+ * that has one without consuming it, or fails with ENOENT. With len too
+ * small it fails with EMSGSIZE and len set to what is needed.
+ */
+#define ASYNC_MSG_KEY_SIZE 8
+
+struct asyncmsg_lookup {
+    __u64 key;
+    __u64 addr;         /* room for the payload, key included */
+    __u32 len;          /* in: bytes at addr, out: payload length */
+    __u32 prio;         /* out */
+    __u64 seq;          /* out */
+    __u64 timestamp_ns; /* out */
+};
+
+/*
+ * ASYNC_MSG_SET_FILTER, per open file. Reads only return messages that
+ * pass every condition set, the others are skipped without being copied
+ * and counted in filtered. A fan-out cursor passes them by. A shared queue
+ * can only consume them, so there KEY, AT and ANYWHERE fail with EINVAL
+ * unless ASYNC_MSG_FILTER_DROP says the file may destroy what it does not
+ * want; and ASYNC_MSG_SET_FANOUT 0 fails with EBUSY while a file has such
+ * a filter without DROP. Lanes outside prio_mask are left for other
+ * readers of a shared queue. poll(), eventfds and wakeups report the file
+ * readable once a match is queued, or once a batch of messages without one
+ * waits to be skipped. A zeroed struct removes the filter. Files of a
+ * fan-out group share one cursor, so what one of them passes by is passed
+ * by for the group.
+ */
+#define ASYNC_MSG_FILTER_LEN 32
+
+struct asyncmsg_filter {
+    __u32 flags;        /* ASYNC_MSG_FILTER_* */
+    __u32 prio_mask;    /* bit p lets lane p through, 0 all lanes */
+    __u64 key;          /* ASYNC_MSG_FILTER_KEY */
+    __u32 offset;       /* ASYNC_MSG_FILTER_AT */
+    __u32 len;          /* pattern bytes, 1 .. ASYNC_MSG_FILTER_LEN */
+    __u8 pattern[ASYNC_MSG_FILTER_LEN];
+};
+
+#define ASYNC_MSG_FILTER_KEY 1        /* keyed messages with this key */
+#define ASYNC_MSG_FILTER_AT 2         /* pattern at offset, 0 matches a prefix */
+#define ASYNC_MSG_FILTER_ANYWHERE 4   /* pattern anywhere in the payload */
+#define ASYNC_MSG_FILTER_DROP 8       /* shared queue: consume what does not match */
+
+/*
+ * Dead letters are kept in a bounded ring per queue (the oldest is dropped
+ * when it is full) and spilled to the DLQ file in the background.
+ * ASYNC_MSG_DLQ_READ moves as many of them as fit into addr as struct
+ * asyncmsg_rec with the reason and the lane (ASYNC_MSG_REC_PRIO) in flags
+ * and returns the bytes written. ASYNC_MSG_DLQ_REPLAY n puts up to n of
+ * them back into the lanes they came from (n <= 0: all that fit) and returns how many went.
+ */
+struct asyncmsg_dlq_read {
+    __u64 addr;
+    __u32 len;
+    __u32 count;    /* out: records written */
+};
+
+#define ASYNC_MSG_DLQ_QUEUE_FULL 1
+#define ASYNC_MSG_DLQ_WAIT_TIMEOUT 2
+#define ASYNC_MSG_DLQ_LEASE_LOST 3    /* unacked at close and its lane was full */
+#define ASYNC_MSG_DLQ_EXPIRED 4       /* ASYNC_MSG_TTL_DLQ */
+#define ASYNC_MSG_DLQ_REASONS 4       /* reasons are 1 .. ASYNC_MSG_DLQ_REASONS */
+
+/*
+ * ASYNC_MSG_GET_STATS. The caller sets size to sizeof(struct asyncmsg_stats)
+ * as it was built with, the driver fills that much (or what it knows of) and
+ * returns version and the size it filled. Fields are only ever appended.
+ * Counters are summed from per-CPU copies without a lock, so two of them
+ * may be a few messages apart.
+ */
+#define ASYNC_MSG_STATS_VERSION 2     /* 2: dlq[] is indexed by reason - 1 */
+#define ASYNC_MSG_LAT_BUCKETS 40
+
+struct asyncmsg_stats {
+    __u32 version;          /* out */
+    __u32 size;             /* in/out */
+    __u32 flags;            /* in: ASYNC_MSG_STATS_* */
+    __u32 open_count;
+
+    __u64 enqueued;         /* messages */
+    __u64 dequeued;         /* fan-out: once the slowest cursor passed it */
+    __u64 enqueued_bytes;
+    __u64 dequeued_bytes;
+    __u64 dlq[ASYNC_MSG_DLQ_REASONS];   /* dlq[reason - 1] by ASYNC_MSG_DLQ_* reason */
+    __u64 dlq_dropped;      /* pushed out of the full DLQ ring */
+    __u64 rate_limited;     /* messages refused with EAGAIN by a rate limit */
+    __u64 wait_timeouts;    /* writes that failed with ETIMEDOUT */
+
+    __u64 depth;
+    __u64 depth_hwm;        /* highest depth since load or the last reset */
+    __u64 max_queue_size;
+
+    /*
+     * Enqueue to dequeue latency: lat_ns[0] counts 0 ns, lat_ns[i] counts
+     * [2^(i-1), 2^i) ns, the last bucket everything above.
+     */
+    __u64 lat_ns[ASYNC_MSG_LAT_BUCKETS];
+
+    __u64 lane_depth[ASYNC_MSG_PRIO_LEVELS];
+    __u64 expired;          /* dropped by their TTL, ASYNC_MSG_TTL_DLQ or not */
+    __u64 compacted;        /* keyed writes that overwrote a queued message */
+    __u64 filtered;         /* dropped or passed by for a read filter */
+};
+
+#define ASYNC_MSG_STATS_RESET_HWM 1   /* depth_hwm starts over from the current depth */
+
+/*
+ * io_uring passthrough (IORING_OP_URING_CMD with one of the cmd_ops below).
+ * The SQE command area holds a struct asyncmsg_uring_cmd. The CQE result is
+ * what a framed write() or binary read() would return. A command the queue
+ * cannot serve yet is parked and completes once it can, no thread waits
+ * for it.
+ */
+#define ASYNC_MSG_URING_ENQUEUE _IOW(ASYNC_MSG_IOC_MAGIC, 0x80, struct asyncmsg_uring_cmd)
+#define ASYNC_MSG_URING_DEQUEUE _IOR(ASYNC_MSG_IOC_MAGIC, 0x81, struct asyncmsg_uring_cmd)
+
+struct asyncmsg_uring_cmd {
+    __u64 addr;     /* framed records to queue, or room for binary records */
+    __u32 len;
+    __u32 flags;    /* must be 0 */
+};
+
+// longest payload a message can carry
+#define ASYNC_MSG_MAX_LEN (16 * 1024)
+
+// asyncmsg_rec.flags
+#define ASYNC_MSG_REC_PAD 1       /* shared rings only: skip to the start of the ring */
+#define ASYNC_MSG_REC_CLASSES 2   /* struct asyncmsg_classes sits between header and payload */
+#define ASYNC_MSG_REC_PRIO_SET 4  /* framed writes: the lane comes from ASYNC_MSG_REC_PRIO */
+#define ASYNC_MSG_REC_REDELIVERED 8   /* a lease on it expired before the ack */
+#define ASYNC_MSG_REC_TTL 16      /* framed writes: timestamp_ns is this message's TTL in ms, 0 none */
+#define ASYNC_MSG_REC_KEY 32      /* the payload starts with a __u64 key */
+#define ASYNC_MSG_REC_PRIO_SHIFT 8
+#define ASYNC_MSG_REC_PRIO(flags) (((flags) >> ASYNC_MSG_REC_PRIO_SHIFT) & 0xff)
+
+#define ASYNC_MSG_REC_ALIGN 8
+#define ASYNC_MSG_REC_SIZE(len) \
+    ((sizeof(struct asyncmsg_rec) + (len) + ASYNC_MSG_REC_ALIGN - 1) & ~(size_t)(ASYNC_MSG_REC_ALIGN - 1))
+
+/*
+ * Character classes of a payload, counted by the driver after enqueue.
+ * With ASYNC_MSG_REC_CLASSES the record takes
+ * ASYNC_MSG_REC_SIZE(sizeof(struct asyncmsg_classes) + len) bytes.
+ */
+struct asyncmsg_classes {
+    __u16 alpha;    /* ASCII letters */
+    __u16 digit;
+    __u16 space;    /* ' ' and \t \n \v \f \r */
+    __u16 other;
+};
+
+/*
+ * Shared rings, set up by mmap() of the device at offset 0 with length
+ * PAGE_SIZE + 2 * ring size, where ring size is a power of two between
+ * ASYNC_MSG_RING_MIN and ASYNC_MSG_RING_MAX. The first page holds the control block
+ * below, the tx ring (user -> queue) and rx ring (queue -> user) follow.
+ *
+ * Both rings carry asyncmsg_rec framed records, indices are free-running
+ * byte counters. A record never wraps: if less than a header is left before
+ * the end of the ring the producer moves to the start, if a header fits but
+ * the record does not it writes a header with ASYNC_MSG_REC_PAD first.
+ *
+ * Userspace writes tx_tail and rx_head, the driver writes tx_head and
+ * rx_tail. Publish with a release store and read the other side with an
+ * acquire load. ASYNC_MSG_RING_KICK moves the pending records, poll() says
+ * when a kick has work to do.
+ */
+#define ASYNC_MSG_RING_MIN (64 * 1024)
+#define ASYNC_MSG_RING_MAX (1024 * 1024)
+
+// ASYNC_MSG_RING_KICK argument
+#define ASYNC_MSG_KICK_TX 1       /* queue everything between tx_head and tx_tail */
+#define ASYNC_MSG_KICK_RX 2       /* move ready messages into the rx ring */
+
+struct asyncmsg_ring_ctl {
+    __u32 tx_head;
+    __u32 pad0[15];
+    __u32 tx_tail;
+    __u32 pad1[15];
+    __u32 rx_head;
+    __u32 pad2[15];
+    __u32 rx_tail;
+    __u32 pad3[15];
+    __u32 ring_size;
+    __u32 flags;
+    __u64 tx_off;   /* offsets from the start of the mapping */
+    __u64 rx_off;
+};
+
+#endif
@@ -15,7 +15,7 @@ echo "[*] Inserting module..."
 sudo insmod asyncmsg.ko
 
 echo "[*] Setting permissions..."
-sudo chmod 666 /dev/asyncmsg
+sudo chmod 666 /dev/asyncmsg*
 
 echo "[+] Done! Module reloaded and ready."
 
@@ -0,0 +1,203 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+
+#include "../asyncmsg_uapi.h"
+
+#define DEVICE_PATH "/dev/asyncmsg0"
+
+int main() {
+    char buf[4096];
+    int fd = open(DEVICE_PATH, O_RDWR);
+    if (fd < 0) {
+        perror("Failed to open device");
+        return 1;
+    }
+
+    // пишемо кілька повідомлень одним write() у framed режимі
+    int wmode = ASYNC_MSG_WRITE_FRAMED;
+    if (ioctl(fd, ASYNC_MSG_SET_WRITE_MODE, &wmode) == -1) {
+        perror("ASYNC_MSG_SET_WRITE_MODE failed");
+        close(fd);
+        return 1;
+    }
+    size_t woff = 0;
+    memset(buf, 0, sizeof(buf));
+    for (int i = 0; i < 3; i++) {
+        struct asyncmsg_rec *rec = (struct asyncmsg_rec *)(buf + woff);
+        rec->len = snprintf((char *)(rec + 1), 32, "binary message %d", i);
+        woff += ASYNC_MSG_REC_SIZE(rec->len);
+    }
+    ssize_t w = write(fd, buf, woff);
+    if (w < 0)
+        perror("framed write");
+    else
+        printf("framed write accepted %zd of %zu bytes\n", w, woff);
+
+    wmode = ASYNC_MSG_WRITE_RAW;
+    ioctl(fd, ASYNC_MSG_SET_WRITE_MODE, &wmode);
+
+    int mode = ASYNC_MSG_READ_BINARY;
+    if (ioctl(fd, ASYNC_MSG_SET_READ_MODE, &mode) == -1) {
+        perror("ASYNC_MSG_SET_READ_MODE failed");
+        close(fd);
+        return 1;
+    }
+
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n < 0) {
+        perror("read");
+        close(fd);
+        return 1;
+    }
+    printf("read() returned %zd bytes\n", n);
+
+    size_t off = 0;
+    while (off + sizeof(struct asyncmsg_rec) <= (size_t)n) {
+        struct asyncmsg_rec *rec = (struct asyncmsg_rec *)(buf + off);
+        printf("seq=%llu ts=%llu len=%u msg=%.*s\n",
+               (unsigned long long)rec->seq, (unsigned long long)rec->timestamp_ns,
+               rec->len, (int)rec->len, (char *)(rec + 1));
+        off += ASYNC_MSG_REC_SIZE(rec->len);
+    }
+
+    // буфер, менший за один запис, не розрізає запис, а повертає EMSGSIZE
+    if (write(fd, "tiny", 4) < 0)
+        perror("write");
+    if (read(fd, buf, sizeof(struct asyncmsg_rec)) < 0 && errno == EMSGSIZE)
+        printf("short buffer: EMSGSIZE as expected\n");
+
+    // довге повідомлення більше не обрізається
+    static char big[ASYNC_MSG_MAX_LEN];
+    static char big_rec[ASYNC_MSG_REC_SIZE(ASYNC_MSG_MAX_LEN)];
+    memset(big, 'x', sizeof(big));
+    if (write(fd, big, sizeof(big)) != sizeof(big))
+        perror("big write");
+    // "tiny" з попередньої перевірки ще в черзі, тож читаємо до двох разів
+    for (int i = 0; i < 2; i++) {
+        n = read(fd, big_rec, sizeof(big_rec));
+        struct asyncmsg_rec *rec = (struct asyncmsg_rec *)big_rec;
+        if (n > 0 && rec->len > 4) {
+            printf("big message: len=%u (%s)\n", rec->len,
+                   rec->len == sizeof(big) ? "ok" : "truncated");
+            break;
+        }
+    }
+
+    // splice: записи йдуть з пристрою в pipe без копіювання через userspace
+    int pfd[2];
+    if (pipe(pfd) == 0) {
+        write(fd, "spliced", 7);
+        ssize_t moved = splice(fd, NULL, pfd[1], NULL, sizeof(big_rec), 0);
+        printf("splice moved %zd bytes into the pipe\n", moved);
+        close(pfd[0]);
+        close(pfd[1]);
+    }
+
+    // класи символів: структура asyncmsg_classes між заголовком і текстом
+    mode = ASYNC_MSG_READ_BINARY_CLASSES;
+    if (ioctl(fd, ASYNC_MSG_SET_READ_MODE, &mode) == 0) {
+        write(fd, "Hello, world 2024!", 18);
+        n = read(fd, buf, sizeof(buf));
+        struct asyncmsg_rec *rec = (struct asyncmsg_rec *)buf;
+        if (n > 0 && (rec->flags & ASYNC_MSG_REC_CLASSES)) {
+            struct asyncmsg_classes *cls = (struct asyncmsg_classes *)(rec + 1);
+            printf("classes: alpha=%u digit=%u space=%u other=%u msg=%.*s\n",
+                   cls->alpha, cls->digit, cls->space, cls->other,
+                   (int)rec->len, (char *)(cls + 1));
+        }
+    }
+
+    // пріоритети: bulk у смугу 0, термінове у смугу 3 - читається першим
+    mode = ASYNC_MSG_READ_BINARY;
+    ioctl(fd, ASYNC_MSG_SET_READ_MODE, &mode);
+    write(fd, "bulk", 4);
+    struct asyncmsg_prio pr = { .prio = 3, .policy = ASYNC_MSG_PRIO_STRICT };
+    if (ioctl(fd, ASYNC_MSG_SET_PRIO, &pr) == -1) {
+        perror("ASYNC_MSG_SET_PRIO failed");
+    } else {
+        write(fd, "urgent", 6);
+        n = read(fd, buf, sizeof(buf));
+        off = 0;
+        while (n > 0 && off + sizeof(struct asyncmsg_rec) <= (size_t)n) {
+            struct asyncmsg_rec *rec = (struct asyncmsg_rec *)(buf + off);
+            printf("prio=%u msg=%.*s\n", ASYNC_MSG_REC_PRIO(rec->flags),
+                   (int)rec->len, (char *)(rec + 1));
+            off += ASYNC_MSG_REC_SIZE(rec->len);
+        }
+    }
+
+    // at-least-once: непідтверджене повідомлення повертається після таймауту
+    pr.prio = 0;
+    ioctl(fd, ASYNC_MSG_SET_PRIO, &pr);
+    struct asyncmsg_visibility vis = { .timeout_ms = 200 };
+    if (ioctl(fd, ASYNC_MSG_SET_VISIBILITY, &vis) == -1) {
+        perror("ASYNC_MSG_SET_VISIBILITY failed");
+    } else {
+        write(fd, "leased", 6);
+        for (int i = 0; i < 2; i++) {
+            n = read(fd, buf, sizeof(buf));
+            struct asyncmsg_rec *rec = (struct asyncmsg_rec *)buf;
+            if (n <= 0)
+                break;
+            printf("leased seq=%llu redelivered=%d msg=%.*s\n", (unsigned long long)rec->seq,
+                   !!(rec->flags & ASYNC_MSG_REC_REDELIVERED), (int)rec->len, (char *)(rec + 1));
+            if (i == 0) {
+                usleep(300 * 1000);     // без ack - лізинг спливає
+                continue;
+            }
+            __u64 id = rec->seq;
+            struct asyncmsg_ack ack = { .addr = (unsigned long)&id, .count = 1 };
+            printf("ASYNC_MSG_ACK: %d acked\n", ioctl(fd, ASYNC_MSG_ACK, &ack));
+        }
+        vis.timeout_ms = 0;
+        ioctl(fd, ASYNC_MSG_SET_VISIBILITY, &vis);
+    }
+
+    // TTL: прострочене повідомлення читач не бачить, воно йде в лічильник expired
+    struct asyncmsg_ttl ttl = { .ttl_ms = 100, .sweep_ms = 50 };
+    if (ioctl(fd, ASYNC_MSG_SET_TTL, &ttl) == -1) {
+        perror("ASYNC_MSG_SET_TTL failed");
+    } else {
+        write(fd, "stale", 5);
+        ttl.ttl_ms = 0;
+        ioctl(fd, ASYNC_MSG_SET_TTL, &ttl);
+        usleep(300 * 1000);
+        write(fd, "fresh", 5);
+        n = read(fd, buf, sizeof(buf));
+        struct asyncmsg_rec *rec = (struct asyncmsg_rec *)buf;
+        if (n > 0)
+            printf("after ttl: msg=%.*s\n", (int)rec->len, (char *)(rec + 1));
+        struct asyncmsg_stats st = { .size = sizeof(st) };
+        if (ioctl(fd, ASYNC_MSG_GET_STATS, &st) == 0)
+            printf("expired=%llu\n", (unsigned long long)st.expired);
+    }
+
+    // фільтр: повідомлення без префікса "keep" відкидаються в ядрі, без копіювання.
+    // черга shared, тож без FILTER_DROP ядро відмовило б з EINVAL
+    struct asyncmsg_filter flt = { .flags = ASYNC_MSG_FILTER_AT | ASYNC_MSG_FILTER_DROP, .len = 4 };
+    memcpy(flt.pattern, "keep", 4);
+    if (ioctl(fd, ASYNC_MSG_SET_FILTER, &flt) == -1) {
+        perror("ASYNC_MSG_SET_FILTER failed");
+    } else {
+        write(fd, "drop me", 7);
+        write(fd, "keep me", 7);
+        n = read(fd, buf, sizeof(buf));
+        struct asyncmsg_rec *rec = (struct asyncmsg_rec *)buf;
+        if (n > 0)
+            printf("filtered read: msg=%.*s\n", (int)rec->len, (char *)(rec + 1));
+        struct asyncmsg_stats st = { .size = sizeof(st) };
+        if (ioctl(fd, ASYNC_MSG_GET_STATS, &st) == 0)
+            printf("filtered=%llu\n", (unsigned long long)st.filtered);
+        memset(&flt, 0, sizeof(flt));
+        ioctl(fd, ASYNC_MSG_SET_FILTER, &flt);
+    }
+
+    close(fd);
+    return 0;
+}
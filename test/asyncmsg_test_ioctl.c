@@ -5,15 +5,12 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <errno.h>
+#include <sys/eventfd.h>
 
-#define DEVICE_PATH "/dev/asyncmsg"
+#include "../asyncmsg_uapi.h"
+
+#define DEVICE_PATH "/dev/asyncmsg0"
 
-#define ASYNC_MSG_IOC_MAGIC 't'
-#define ASYNC_MSG_CLEAR_IO _IO(ASYNC_MSG_IOC_MAGIC, 0)
-#define ASYNC_MSG_SET_SIZE _IOW(ASYNC_MSG_IOC_MAGIC, 1, int)
-#define ASYNC_MSG_GET_SIZE _IOR(ASYNC_MSG_IOC_MAGIC, 2, int)
-#define ASYNC_MSG_GET_STAT _IOR(ASYNC_MSG_IOC_MAGIC, 3, int)
-#define ASYNC_MSG_IOC_MXMR 3
 
 int main() {
     char buf[100];
@@ -32,6 +29,19 @@ int main() {
         printf("ASYNC_MSG_GET_STAT:\n%s\n", stats_buf);
     }
 
+    // GET STATS: бінарні лічильники та гістограма затримки
+    struct asyncmsg_stats st = { .size = sizeof(st) };
+    if (ioctl(fd, ASYNC_MSG_GET_STATS, &st) == -1) {
+        perror("ASYNC_MSG_GET_STATS failed");
+    } else {
+        printf("ASYNC_MSG_GET_STATS v%u: enqueued=%llu dequeued=%llu depth=%llu hwm=%llu\n",
+               st.version, (unsigned long long)st.enqueued, (unsigned long long)st.dequeued,
+               (unsigned long long)st.depth, (unsigned long long)st.depth_hwm);
+        for (int i = 0; i < ASYNC_MSG_LAT_BUCKETS; i++)
+            if (st.lat_ns[i])
+                printf("  latency < %llu ns: %llu\n", 1ULL << i, (unsigned long long)st.lat_ns[i]);
+    }
+
 
     strcpy(buf, "Привіт, це тест!");
     ret = write(fd, buf, strlen(buf));
@@ -40,6 +50,13 @@ int main() {
     else
         printf("Записано %d байтів: %s\n", ret, buf);
 
+    // SYNC: повертається коли запис вже на диску
+    if (ioctl(fd, ASYNC_MSG_SYNC) == -1) {
+        perror("ASYNC_MSG_SYNC failed");
+    } else {
+        printf("ASYNC_MSG_SYNC: persisted\n");
+    }
+
     char stats_buf1[512] = {0};
     if (ioctl(fd, ASYNC_MSG_GET_STAT, (void *)stats_buf1) == -1) {
         perror("ASYNC_MSG_GET_STAT failed");
@@ -79,6 +96,156 @@ int main() {
         printf("ASYNC_MSG_GET_STAT:\n%s\n", stats_buf2);
     }
 
+    // CREATE QUEUE: нова черга з'являється як /dev/asyncmsg<N>
+    int new_queue = -1;
+    if (ioctl(fd, ASYNC_MSG_CREATE_QUEUE, &new_queue) == -1) {
+        perror("ASYNC_MSG_CREATE_QUEUE failed");
+    } else {
+        printf("ASYNC_MSG_CREATE_QUEUE: created /dev/asyncmsg%d\n", new_queue);
+    }
+
+    // SET TIMEOUTS: коротке очікування з busy-poll, черга порожня після CLEAR
+    struct asyncmsg_timeouts t = { .read_ms = 200, .write_ms = 200, .busy_poll_us = 50 };
+    ioctl(fd, ASYNC_MSG_CLEAR_IO);
+    if (ioctl(fd, ASYNC_MSG_SET_TIMEOUTS, &t) == -1) {
+        perror("ASYNC_MSG_SET_TIMEOUTS failed");
+    } else if (read(fd, buf, sizeof(buf)) < 0 && errno == EAGAIN) {
+        printf("ASYNC_MSG_SET_TIMEOUTS: empty read timed out with EAGAIN\n");
+    }
+
+    // SET EVENTFD: повідомлення в черзі сигналить eventfd замість SIGIO.
+    // окремий fd: текстовий read() зсуває позицію, і fd далі читав би 0
+    int fde = open(DEVICE_PATH, O_RDWR);
+    int efd = eventfd(0, EFD_NONBLOCK);
+    struct asyncmsg_eventfd ev = { .fd = efd, .events = ASYNC_MSG_EV_IN };
+    if (fde < 0 || efd < 0 || ioctl(fde, ASYNC_MSG_SET_EVENTFD, &ev) == -1) {
+        perror("ASYNC_MSG_SET_EVENTFD failed");
+    } else {
+        uint64_t cnt = 0;
+        write(fde, "eventfd", 7);
+        if (read(efd, &cnt, sizeof(cnt)) == sizeof(cnt))
+            printf("ASYNC_MSG_SET_EVENTFD: eventfd count %llu\n", (unsigned long long)cnt);
+        read(fde, buf, sizeof(buf));
+        ev.fd = -1;
+        ioctl(fde, ASYNC_MSG_SET_EVENTFD, &ev);
+    }
+    if (efd >= 0)
+        close(efd);
+    if (fde >= 0)
+        close(fde);
+
+    // O_NONBLOCK: порожня черга одразу дає EAGAIN
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (read(fd, buf, sizeof(buf)) < 0 && errno == EAGAIN) {
+        printf("O_NONBLOCK: empty read returned EAGAIN\n");
+    }
+
+    // SET RATE: 1 msg/s з burst 2 - третій запис одразу отримує EAGAIN
+    struct asyncmsg_rate rate = { .rate = 1, .burst = 2, .scope = ASYNC_MSG_RATE_FILE };
+    if (ioctl(fd, ASYNC_MSG_SET_RATE, &rate) == -1) {
+        perror("ASYNC_MSG_SET_RATE failed");
+    } else {
+        for (int i = 0; i < 3; i++) {
+            if (write(fd, "burst", 5) < 0)
+                printf("ASYNC_MSG_SET_RATE: write %d -> %s\n", i, strerror(errno));
+            else
+                printf("ASYNC_MSG_SET_RATE: write %d accepted\n", i);
+        }
+        rate.rate = 0;
+        ioctl(fd, ASYNC_MSG_SET_RATE, &rate);
+    }
+
+    // DLQ: O_NONBLOCK запис у повну смугу одразу йде в DLQ з EAGAIN,
+    // блокуючий чекає write_ms і потрапляє в DLQ по таймауту
+    ioctl(fd, ASYNC_MSG_CLEAR_IO);
+    while (write(fd, "fill", 4) > 0)
+        ;
+    printf("DLQ: full queue rejected a nonblocking write with %s\n", strerror(errno));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    if (write(fd, "late", 4) < 0)
+        printf("DLQ: blocking write gave up after write_ms with %s\n", strerror(errno));
+    ioctl(fd, ASYNC_MSG_CLEAR_IO);
+    int replay = 1;
+    ret = ioctl(fd, ASYNC_MSG_DLQ_REPLAY, &replay);
+    printf("ASYNC_MSG_DLQ_REPLAY: %d message(s) back in the queue\n", ret);
+
+    // DLQ READ: решту забираємо записами asyncmsg_rec, причина у flags
+    char dlq_buf[4096];
+    struct asyncmsg_dlq_read dr = { .addr = (unsigned long)dlq_buf, .len = sizeof(dlq_buf) };
+    ret = ioctl(fd, ASYNC_MSG_DLQ_READ, &dr);
+    if (ret < 0) {
+        perror("ASYNC_MSG_DLQ_READ failed");
+    } else {
+        for (int off = 0, i = 0; i < (int)dr.count; i++) {
+            struct asyncmsg_rec *rec = (struct asyncmsg_rec *)(dlq_buf + off);
+            printf("ASYNC_MSG_DLQ_READ: reason=%u len=%u msg=%.*s\n", rec->flags,
+                   rec->len, (int)rec->len, (char *)(rec + 1));
+            off += ASYNC_MSG_REC_SIZE(rec->len);
+        }
+    }
+
+    // fan-out: два читачі з різними курсорами отримують те саме повідомлення
+    ioctl(fd, ASYNC_MSG_CLEAR_IO);
+    int fanout = 1;
+    if (ioctl(fd, ASYNC_MSG_SET_FANOUT, &fanout) == -1) {
+        perror("ASYNC_MSG_SET_FANOUT failed");
+    } else {
+        int fd2 = open(DEVICE_PATH, O_RDWR);
+        struct asyncmsg_subscribe sub = { .group = "auditor" };
+        if (ioctl(fd2, ASYNC_MSG_SUBSCRIBE, &sub) == -1)
+            perror("ASYNC_MSG_SUBSCRIBE failed");
+        write(fd, "to everyone", 11);
+        char out[256];
+        for (int i = 0; i < 2; i++) {
+            ssize_t n = read(i ? fd2 : fd, out, sizeof(out) - 1);
+            out[n > 0 ? n : 0] = 0;
+            printf("fan-out reader %d got:\n%s", i, out);
+        }
+
+        struct asyncmsg_cursor_stat cs[4];
+        struct asyncmsg_cursor_list cl = { .addr = (unsigned long)cs, .len = sizeof(cs) };
+        ret = ioctl(fd, ASYNC_MSG_GET_CURSORS, &cl);
+        for (int i = 0; ret >= 0 && i < (int)cl.count; i++)
+            printf("cursor '%s': users=%u delivered=%llu lag=%llu\n", cs[i].group, cs[i].users,
+                   (unsigned long long)cs[i].delivered, (unsigned long long)cs[i].lag);
+
+        close(fd2);
+        fanout = 0;
+        if (ioctl(fd, ASYNC_MSG_SET_FANOUT, &fanout) == -1 && errno == EBUSY)
+            printf("ASYNC_MSG_SET_FANOUT 0: EBUSY while this file still has its cursor\n");
+    }
+
+    // компакція: три оновлення одного ключа займають один слот, lookup бачить останнє
+    int fd3 = open(DEVICE_PATH, O_RDWR);
+    int compact = 1, wmode = ASYNC_MSG_WRITE_FRAMED;
+    ioctl(fd3, ASYNC_MSG_CLEAR_IO);
+    if (ioctl(fd3, ASYNC_MSG_SET_COMPACT, &compact) == -1) {
+        perror("ASYNC_MSG_SET_COMPACT failed");
+    } else {
+        ioctl(fd3, ASYNC_MSG_SET_WRITE_MODE, &wmode);
+        for (int v = 1; v <= 3; v++) {
+            char frame[64] = { 0 };
+            struct asyncmsg_rec *rec = (struct asyncmsg_rec *)frame;
+            __u64 key = 42;
+            memcpy(rec + 1, &key, sizeof(key));
+            rec->len = sizeof(key) + snprintf((char *)(rec + 1) + sizeof(key), 16, "v%d", v);
+            rec->flags = ASYNC_MSG_REC_KEY;
+            write(fd3, frame, ASYNC_MSG_REC_SIZE(rec->len));
+        }
+        struct asyncmsg_stats st = { .size = sizeof(st) };
+        ioctl(fd3, ASYNC_MSG_GET_STATS, &st);
+        char val[64];
+        struct asyncmsg_lookup lk = { .key = 42, .addr = (unsigned long)val, .len = sizeof(val) };
+        if (ioctl(fd3, ASYNC_MSG_LOOKUP, &lk) == 0)
+            printf("key 42: depth=%llu compacted=%llu value=%.*s seq=%llu\n",
+                   (unsigned long long)st.depth, (unsigned long long)st.compacted,
+                   (int)(lk.len - sizeof(__u64)), val + sizeof(__u64), (unsigned long long)lk.seq);
+        compact = 0;
+        ioctl(fd3, ASYNC_MSG_SET_COMPACT, &compact);
+        ioctl(fd3, ASYNC_MSG_CLEAR_IO);
+    }
+    close(fd3);
+
     close(fd);
     return 0;
 }
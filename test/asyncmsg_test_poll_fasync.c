@@ -9,7 +9,9 @@
 #include <errno.h>
 #include <sys/ioctl.h>
 
-#define DEVICE_PATH "/dev/asyncmsg"
+#include "../asyncmsg_uapi.h"
+
+#define DEVICE_PATH "/dev/asyncmsg0"
 
 void sigio_handler(int sig, siginfo_t *info, void *context) {
     printf("[SIGIO] Received signal from fd=%d, si_code=%d\n", info->si_fd, info->si_code);
@@ -51,6 +53,12 @@ int main() {
         return 1;
     }
 
+    // POLLIN тільки коли є 4 повідомлення або через 100 мс після першого
+    struct asyncmsg_watermarks wm = { .rx_lowat = 4, .rx_max_delay_us = 100000, .tx_lowat = 1 };
+    if (ioctl(fd, ASYNC_MSG_SET_WATERMARKS, &wm) == -1) {
+        perror("ASYNC_MSG_SET_WATERMARKS");
+    }
+
     printf("Listening for events on %s (poll + SIGIO)...\n", DEVICE_PATH);
 
     struct pollfd pfd;
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "../asyncmsg_uapi.h"
+
+#define DEVICE_PATH "/dev/asyncmsg0"
+#define ENTRIES 4
+
+// мінімальне кільце io_uring без liburing
+struct ring {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+};
+
+static int ring_init(struct ring *r) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, ENTRIES, &p);
+    if (r->fd < 0)
+        return -1;
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    char *sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    char *cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || r->sqes == MAP_FAILED)
+        return -1;
+
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+// одна команда ASYNC_MSG_URING_* на пристрій, без очікування
+static int submit_cmd(struct ring *r, int dev, __u32 op, void *buf, __u32 len, __u64 tag) {
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    struct asyncmsg_uring_cmd *cmd = (struct asyncmsg_uring_cmd *)sqe->cmd;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_URING_CMD;
+    sqe->fd = dev;
+    sqe->cmd_op = op;
+    sqe->user_data = tag;
+    cmd->addr = (unsigned long)buf;
+    cmd->len = len;
+    cmd->flags = 0;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return syscall(__NR_io_uring_enter, r->fd, 1, 0, 0, NULL, 0);
+}
+
+static int wait_cqe(struct ring *r, struct io_uring_cqe *out) {
+    unsigned head = *r->cq_head;
+
+    while (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        if (syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+            return -1;
+    }
+    *out = r->cqes[head & *r->cq_mask];
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int main() {
+    struct ring r;
+    struct io_uring_cqe cqe;
+    char in[256], out[256];
+
+    int fd = open(DEVICE_PATH, O_RDWR);
+    if (fd < 0) {
+        perror("Failed to open device");
+        return 1;
+    }
+    if (ring_init(&r) < 0) {
+        perror("io_uring_setup");
+        close(fd);
+        return 1;
+    }
+    ioctl(fd, ASYNC_MSG_CLEAR_IO);
+
+    // dequeue на порожній черзі паркується і не тримає жодного потоку
+    if (submit_cmd(&r, fd, ASYNC_MSG_URING_DEQUEUE, out, sizeof(out), 1) < 0)
+        perror("submit dequeue");
+
+    // два записи одним enqueue, той самий формат, що й framed write()
+    size_t off = 0;
+    for (int i = 0; i < 2; i++) {
+        struct asyncmsg_rec *rec = (struct asyncmsg_rec *)(in + off);
+        memset(rec, 0, sizeof(*rec));
+        rec->len = snprintf((char *)(rec + 1), 32, "uring message %d", i);
+        off += ASYNC_MSG_REC_SIZE(rec->len);
+    }
+    if (submit_cmd(&r, fd, ASYNC_MSG_URING_ENQUEUE, in, off, 2) < 0)
+        perror("submit enqueue");
+
+    // порядок CQE не гарантований: enqueue будить запаркований dequeue
+    for (int i = 0; i < 2; i++) {
+        if (wait_cqe(&r, &cqe) < 0) {
+            perror("io_uring_enter");
+            break;
+        }
+        if (cqe.user_data == 2) {
+            printf("enqueue completed with %d\n", cqe.res);
+            continue;
+        }
+        printf("dequeue completed with %d\n", cqe.res);
+        for (int pos = 0; pos < cqe.res;) {
+            struct asyncmsg_rec *rec = (struct asyncmsg_rec *)(out + pos);
+            printf("seq=%llu len=%u msg=%.*s\n", (unsigned long long)rec->seq,
+                   rec->len, (int)rec->len, (char *)(rec + 1));
+            pos += ASYNC_MSG_REC_SIZE(rec->len);
+        }
+    }
+
+    close(r.fd);
+    close(fd);
+    return 0;
+}